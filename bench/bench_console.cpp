@@ -0,0 +1,88 @@
+/*
+Measures the throughput of the console stream buffers with in-memory utf-16 sinks and sources,
+so that it can run on any system. Writes and reads about 1 GB per case, or as many MB as given
+on the command line.
+
+Build, for example:
+g++ -O2 -I.. bench_console.cpp ../libpu8.cpp -o bench_console
+*/
+
+#include <libpu8.h>
+
+#include "corpus.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+// writes total bytes of text to the buffer, in pieces of piece bytes
+static double write_mb_per_s(const std::string& text, size_t piece, size_t total)
+{
+    std::u16string out;
+    U8ConsoleOstreamBuf<U8MemorySink> buf((U8MemorySink(out)));
+    std::ostream os(&buf);
+    size_t written = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    while (written < total)
+    {
+        for (size_t i = 0; i < text.size(); i += piece)
+            os.write(text.data() + i, std::streamsize(text.size() - i < piece ? text.size() - i : piece));
+        os.flush();
+        written += text.size();
+        // keeps the capacity
+        out.clear();
+    }
+    return double(written) / seconds_since(start) / 1e6;
+}
+
+// reads total bytes of text from the buffer, with getline or in pieces of piece bytes
+static double read_mb_per_s(const std::u16string& input, size_t piece, size_t total)
+{
+    std::string line;
+    std::vector<char> block(piece ? piece : 1);
+    size_t read = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    while (read < total)
+    {
+        U8ConsoleIstreamBuf<U8MemorySource> buf(U8MemorySource(input.data(), input.size()));
+        std::istream is(&buf);
+        if (!piece)
+        {
+            while (std::getline(is, line))
+                read += line.size() + 1;
+        }
+        else
+        {
+            while (is.read(&block[0], std::streamsize(piece)) || is.gcount())
+                read += size_t(is.gcount());
+        }
+    }
+    return double(read) / seconds_since(start) / 1e6;
+}
+
+int main(int argc, char** argv)
+{
+    size_t total = size_t(argc > 1 ? std::atoi(argv[1]) : 1000) * 1000000;
+
+    // wikipedia-like paragraphs in twelve scripts, one per line
+    std::string text = make_corpus("multilingual", 16u << 20, 42);
+    std::u16string input = u8to16(text);
+
+    std::printf("%-28s %10s\n", "case", "MB/s");
+    std::printf("%-28s %10.0f\n", "write 1 byte pieces", write_mb_per_s(text, 1, total / 16));
+    std::printf("%-28s %10.0f\n", "write 80 byte pieces", write_mb_per_s(text, 80, total));
+    std::printf("%-28s %10.0f\n", "write 64K pieces", write_mb_per_s(text, 64 << 10, total));
+    std::printf("%-28s %10.0f\n", "getline", read_mb_per_s(input, 0, total));
+    std::printf("%-28s %10.0f\n", "read 64K pieces", read_mb_per_s(input, 64 << 10, total));
+    return 0;
+}
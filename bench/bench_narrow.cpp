@@ -0,0 +1,99 @@
+/*
+Measures the two ways to return a converted string: a single pass into a buffer for the worst case
+of 3 bytes per utf-16 code unit, which is then trimmed, and a first pass that counts the bytes
+followed by a conversion into a string of exactly that size.
+On windows these are u8narrow (WideCharToMultiByte into 3 * len bytes) and two WideCharToMultiByte
+calls. Elsewhere they are u16to8_into followed by shrink_to_fit, and u16to8, which counts with
+u16to8_length.
+
+Build, for example:
+g++ -O2 -I.. bench_narrow.cpp ../libpu8.cpp -o bench_narrow
+*/
+
+#include <libpu8.h>
+
+#include "corpus.h"
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+#ifdef _WIN32
+
+typedef wchar_t u16char;
+
+static std::string narrow_one_pass(const std::wstring& s)
+{
+    return u8narrow(s);
+}
+
+static std::string narrow_two_pass(const std::wstring& s)
+{
+    int ilen = int(s.size());
+    int utf8_bytes = WideCharToMultiByte(CP_UTF8, WC_ERR_INVALID_CHARS, s.data(), ilen, 0, 0, 0, 0);
+    std::string result;
+    result.resize(size_t(utf8_bytes));
+    WideCharToMultiByte(CP_UTF8, WC_ERR_INVALID_CHARS, s.data(), ilen, &result[0], utf8_bytes, 0, 0);
+    return result;
+}
+
+#else
+
+typedef char16_t u16char;
+
+// what u16to8 did before it counted first
+static std::string narrow_one_pass(const std::u16string& s)
+{
+    std::string result;
+    u16to8_into(s, result);
+    result.shrink_to_fit();
+    return result;
+}
+
+static std::string narrow_two_pass(const std::u16string& s)
+{
+    return u16to8(s);
+}
+
+#endif
+
+typedef std::basic_string<u16char> u16str;
+
+// the mixed corpus of libpu8_bench: ascii, latin-1, cjk and emoji words
+static u16str make_input(size_t utf8_bytes)
+{
+    std::string text = make_corpus("mixed", utf8_bytes, 42);
+#ifdef _WIN32
+    return u8widen(text);
+#else
+    return u8to16(text);
+#endif
+}
+
+template <class Fn>
+static double measure_mb_per_s(Fn fn, const u16str& input)
+{
+    size_t iterations = 1 + (256u << 20) / (input.size() * sizeof(u16char));
+    size_t sink = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i)
+        sink += fn(input).size();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if (!sink)
+        std::printf("(empty)\n");
+    return double(iterations * input.size() * sizeof(u16char)) / elapsed.count() / 1e6;
+}
+
+int main()
+{
+    static const size_t sizes[] = { 1 << 10, 64 << 10, 16 << 20 };
+    std::printf("%10s %16s %16s %8s\n", "utf-8", "two-pass MB/s", "one-pass MB/s", "gain");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+    {
+        u16str input = make_input(sizes[i]);
+        double two_pass = measure_mb_per_s(narrow_two_pass, input);
+        double one_pass = measure_mb_per_s(narrow_one_pass, input);
+        std::printf("%9zuK %16.0f %16.0f %7.2fx\n", sizes[i] >> 10, two_pass, one_pass, one_pass / two_pass);
+    }
+    return 0;
+}
@@ -0,0 +1,319 @@
+#ifndef corpus_h__
+#define corpus_h__
+
+/*
+Generates reproducible utf-8 benchmark text. The same name, size and seed give the same bytes on
+every platform. Used by the benchmarks and make_corpus.
+
+synthetic:    ascii, latin1, cjk, emoji, mixed (the script changes between words) and invalid
+              (mixed with about one random byte in 64)
+wikipedia:    paragraphs with headings, numbers, links and latin names in one of the scripts in
+              corpus_scripts, or in all of them (multilingual)
+logs:         log lines that name files with utf-8 names
+paths:        short absolute paths, one per line, like those given on the command line
+*/
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// xorshift, so that the text does not depend on the standard library
+class corpus_random
+{
+public:
+    explicit corpus_random(uint32_t seed) : m_state((seed * 2654435761u) ^ 0x9e3779b9u)
+    {
+        if (!m_state)
+            m_state = 1;
+    }
+    uint32_t next()
+    {
+        m_state ^= m_state << 13;
+        m_state ^= m_state >> 17;
+        m_state ^= m_state << 5;
+        return m_state;
+    }
+    uint32_t below(uint32_t n) { return next() % n; }
+    bool percent(unsigned p) { return below(100) < p; }
+    uint32_t between(uint32_t first, uint32_t last) { return first + below(last - first + 1); }
+private:
+    uint32_t m_state;
+};
+
+inline void append_utf8(std::string& s, uint32_t cp)
+{
+    if (cp < 0x80)
+        s += char(cp);
+    else if (cp < 0x800)
+    {
+        s += char(0xc0 | (cp >> 6));
+        s += char(0x80 | (cp & 0x3f));
+    }
+    else if (cp < 0x10000)
+    {
+        s += char(0xe0 | (cp >> 12));
+        s += char(0x80 | ((cp >> 6) & 0x3f));
+        s += char(0x80 | (cp & 0x3f));
+    }
+    else
+    {
+        s += char(0xf0 | (cp >> 18));
+        s += char(0x80 | ((cp >> 12) & 0x3f));
+        s += char(0x80 | ((cp >> 6) & 0x3f));
+        s += char(0x80 | (cp & 0x3f));
+    }
+}
+
+struct corpus_script
+{
+    const char* name;
+    // letters are taken from [first, last], or with other_percent percent from [other_first, other_last]
+    uint32_t first, last;
+    uint32_t other_first, other_last;
+    unsigned other_percent;
+    unsigned min_word, max_word;
+    // between words and after a sentence
+    const char* space;
+    const char* full_stop;
+};
+
+static const corpus_script corpus_scripts[] = {
+    { "english", 'a', 'z', 'A', 'Z', 2, 1, 10, " ", ". " },
+    { "german", 'a', 'z', 0xdf, 0xfc, 4, 2, 12, " ", ". " },
+    { "vietnamese", 'a', 'z', 0x1ea0, 0x1ef9, 30, 1, 6, " ", ". " },
+    { "greek", 0x3b1, 0x3c9, 0x3ac, 0x3af, 10, 2, 10, " ", ". " },
+    { "russian", 0x430, 0x44f, 0x410, 0x42f, 3, 2, 11, " ", ". " },
+    { "hebrew", 0x5d0, 0x5ea, 0x5d0, 0x5ea, 0, 2, 7, " ", ". " },
+    { "arabic", 0x628, 0x64a, 0x64b, 0x652, 3, 2, 8, " ", ". " },
+    { "hindi", 0x915, 0x939, 0x93e, 0x94c, 40, 2, 7, " ", "\xe0\xa5\xa4 " },
+    { "thai", 0xe01, 0xe2e, 0xe30, 0xe39, 30, 3, 12, "", " " },
+    { "chinese", 0x4e00, 0x9fa5, 0xff0c, 0xff0c, 5, 1, 4, "", "\xe3\x80\x82" },
+    { "japanese", 0x3041, 0x3093, 0x4e00, 0x9fa5, 35, 1, 5, "", "\xe3\x80\x82" },
+    { "korean", 0xac00, 0xd7a3, 0xac00, 0xd7a3, 0, 1, 5, " ", ". " },
+};
+
+static const size_t corpus_script_count = sizeof(corpus_scripts) / sizeof(corpus_scripts[0]);
+
+static const char* const corpus_synthetic_names[] = { "ascii", "latin1", "cjk", "emoji", "mixed", "invalid" };
+
+inline void append_word(std::string& s, const corpus_script& script, corpus_random& r)
+{
+    unsigned n = r.between(script.min_word, script.max_word);
+    for (unsigned i = 0; i < n; ++i)
+    {
+        if (script.other_percent && r.percent(script.other_percent))
+            append_utf8(s, r.between(script.other_first, script.other_last));
+        else
+            append_utf8(s, r.between(script.first, script.last));
+    }
+}
+
+// english mostly, since most file and user names are
+inline const corpus_script& random_name_script(corpus_random& r)
+{
+    return corpus_scripts[r.percent(60) ? 0 : r.below(corpus_script_count)];
+}
+
+inline void append_paragraph(std::string& s, const corpus_script& script, corpus_random& r)
+{
+    if (r.below(6) == 0)
+    {
+        s += "== ";
+        append_word(s, script, r);
+        s += " ==\n";
+    }
+    unsigned sentences = r.between(3, 8);
+    for (unsigned i = 0; i < sentences; ++i)
+    {
+        unsigned words = r.between(5, 20);
+        for (unsigned j = 0; j < words; ++j)
+        {
+            if (j)
+                s += script.space[0] && r.below(10) == 0 ? ", " : script.space;
+            unsigned k = r.below(100);
+            if (k < 4)
+                s += std::to_string(r.between(1, 2024));
+            else if (k < 6)
+            {
+                s += "[[";
+                append_word(s, script, r);
+                s += "]]";
+            }
+            else if (k < 8)
+            {
+                s += "(";
+                append_word(s, corpus_scripts[0], r);
+                s += ")";
+            }
+            else
+                append_word(s, script, r);
+        }
+        s += script.full_stop;
+    }
+    s += "\n\n";
+}
+
+inline void append_path(std::string& s, corpus_random& r)
+{
+    bool windows = r.below(2) == 0;
+    char separator = windows ? '\\' : '/';
+    s += windows ? "C:\\Users\\" : "/home/";
+    append_word(s, random_name_script(r), r);
+    unsigned directories = r.below(4);
+    for (unsigned i = 0; i < directories; ++i)
+    {
+        s += separator;
+        append_word(s, random_name_script(r), r);
+    }
+    s += separator;
+    const corpus_script& script = random_name_script(r);
+    unsigned words = r.between(1, 3);
+    for (unsigned i = 0; i < words; ++i)
+    {
+        if (i)
+            s += r.below(2) ? ' ' : '_';
+        append_word(s, script, r);
+    }
+    static const char* const extensions[] = { ".txt", ".log", ".csv", ".json", ".jpg", ".pdf", ".docx", "" };
+    s += extensions[r.below(sizeof(extensions) / sizeof(extensions[0]))];
+}
+
+inline void append_log_line(std::string& s, corpus_random& r, unsigned& seconds)
+{
+    static const char* const levels[] = { "INFO ", "INFO ", "INFO ", "DEBUG", "WARN ", "ERROR" };
+    static const char* const messages[] = { "opened ", "wrote to ", "could not open ", "renamed ", "skipped " };
+    seconds += r.below(3);
+    char prefix[64];
+    std::snprintf(prefix, sizeof(prefix), "2024-05-%02u %02u:%02u:%02u.%03u %s [worker-%u] ", 1 + seconds / 86400 % 28,
+        seconds / 3600 % 24, seconds / 60 % 60, seconds % 60, unsigned(r.below(1000)), levels[r.below(6)], unsigned(r.below(16)));
+    s += prefix;
+    s += messages[r.below(5)];
+    s += '"';
+    append_path(s, r);
+    s += '"';
+    if (r.below(2))
+        s += " (" + std::to_string(r.below(1u << 20)) + " bytes)";
+    s += '\n';
+}
+
+inline uint32_t synthetic_code_point(size_t kind, corpus_random& r)
+{
+    // a space or punctuation every few characters, as in text
+    if (r.below(8) == 0)
+        return " ,.\n"[r.below(4)];
+    switch (kind)
+    {
+    case 1:
+        return r.below(2) ? r.between(0xe0, 0xff) : r.between('a', 'z');
+    case 2:
+        return r.between(0x4e00, 0x9fff);
+    case 3:
+        return r.between(0x1f300, 0x1f64f);
+    default:
+        return r.between('a', 'z');
+    }
+}
+
+inline void append_synthetic(std::string& s, size_t kind, size_t size, corpus_random& r)
+{
+    bool mixed = kind >= 4;
+    size_t script = mixed ? 0 : kind;
+    while (s.size() < size)
+    {
+        uint32_t cp = synthetic_code_point(script, r);
+        append_utf8(s, cp);
+        // mixed text changes the script between words
+        if (mixed && cp <= '.')
+            script = r.below(4);
+    }
+}
+
+// cuts s to size bytes without splitting a code point, and pads it with spaces
+inline void fit_utf8(std::string& s, size_t size)
+{
+    if (s.size() > size)
+    {
+        size_t end = size;
+        while (end > 0 && (s[end] & 0xc0) == 0x80)
+            --end;
+        s.resize(end);
+    }
+    s.resize(size, ' ');
+}
+
+// returns size bytes of the named corpus, or an empty string if there is no such corpus
+inline std::string make_corpus(const std::string& name, size_t size, uint32_t seed)
+{
+    corpus_random r(seed);
+    std::string s;
+    s.reserve(size + 256);
+    for (size_t i = 0; i < 6; ++i)
+    {
+        if (name == corpus_synthetic_names[i])
+            append_synthetic(s, i, size, r);
+    }
+    for (size_t i = 0; i < corpus_script_count; ++i)
+    {
+        if (name == corpus_scripts[i].name)
+        {
+            while (s.size() < size)
+                append_paragraph(s, corpus_scripts[i], r);
+        }
+    }
+    if (name == "multilingual")
+    {
+        while (s.size() < size)
+            append_paragraph(s, corpus_scripts[r.below(corpus_script_count)], r);
+    }
+    else if (name == "logs")
+    {
+        unsigned seconds = 0;
+        while (s.size() < size)
+            append_log_line(s, r, seconds);
+    }
+    else if (name == "paths")
+    {
+        while (s.size() < size)
+        {
+            append_path(s, r);
+            s += '\n';
+        }
+    }
+    if (s.empty())
+        return s;
+    fit_utf8(s, size);
+    if (name == "invalid")
+    {
+        for (size_t i = 0; i < s.size(); ++i)
+        {
+            uint32_t x = r.next();
+            if (x % 64 == 0)
+                s[i] = char(x >> 24);
+        }
+    }
+    return s;
+}
+
+inline std::vector<std::string> make_paths(size_t count, uint32_t seed)
+{
+    corpus_random r(seed);
+    std::vector<std::string> paths(count);
+    for (size_t i = 0; i < count; ++i)
+        append_path(paths[i], r);
+    return paths;
+}
+
+inline std::vector<std::string> corpus_names()
+{
+    std::vector<std::string> names(corpus_synthetic_names, corpus_synthetic_names + 6);
+    for (size_t i = 0; i < corpus_script_count; ++i)
+        names.push_back(corpus_scripts[i].name);
+    names.push_back("multilingual");
+    names.push_back("logs");
+    names.push_back("paths");
+    return names;
+}
+
+#endif
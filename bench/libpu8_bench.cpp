@@ -0,0 +1,357 @@
+/*
+Google Benchmark suite for the conversion functions, the validation and the console stream buffers.
+Every benchmark runs on each corpus (ascii, latin1, cjk, emoji, mixed, invalid, multilingual,
+logs) in sizes from 8 bytes to 64 MB; the path benchmarks convert many short paths one by one. bytes_per_second counts utf-8 bytes in both directions, chars/s code points.
+
+Build with cmake (target libpu8_bench), or for example:
+g++ -O2 -I.. libpu8_bench.cpp ../libpu8.cpp -lbenchmark -lpthread -o libpu8_bench
+*/
+
+#include <libpu8.h>
+
+#include "corpus.h"
+
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// the synthetic corpora, then realistic text (see corpus.h)
+static const char* const bench_corpora[] = { "ascii", "latin1", "cjk", "emoji", "mixed", "invalid", "multilingual", "logs" };
+static const int bench_corpus_count = int(sizeof(bench_corpora) / sizeof(bench_corpora[0]));
+
+struct corpus
+{
+    int kind;
+    size_t size;
+    std::string utf8;
+    std::u16string utf16;
+    std::u32string utf32;
+    size_t chars;
+};
+
+static size_t count_chars(const std::u16string& s)
+{
+    size_t chars = 0;
+    for (size_t i = 0; i < s.size(); ++i)
+        chars += (s[i] & 0xfc00) != 0xdc00;
+    return chars;
+}
+
+// keeps only the last corpus, since the benchmarks run one corpus after the other
+static const corpus& get_corpus(int kind, size_t size)
+{
+    static corpus c = { -1, 0, std::string(), std::u16string(), std::u32string(), 0 };
+    if (c.kind != kind || c.size != size)
+    {
+        c.kind = kind;
+        c.size = size;
+        c.utf8 = make_corpus(bench_corpora[kind], size, 1);
+        c.utf16 = u8to16(c.utf8, false);
+        c.utf32 = u8to32(c.utf8, false);
+        c.chars = count_chars(c.utf16);
+    }
+    return c;
+}
+
+static const corpus& start(benchmark::State& state)
+{
+    const corpus& c = get_corpus(int(state.range(0)), size_t(state.range(1)));
+    state.SetLabel(bench_corpora[c.kind]);
+    return c;
+}
+
+static void set_processed(benchmark::State& state, const corpus& c)
+{
+    state.SetBytesProcessed(int64_t(state.iterations()) * int64_t(c.utf8.size()));
+    state.counters["chars/s"] = benchmark::Counter(double(state.iterations()) * double(c.chars), benchmark::Counter::kIsRate);
+}
+
+static void corpus_args(benchmark::internal::Benchmark* b)
+{
+    static const int64_t sizes[] = { 8, 64, 1 << 10, 64 << 10, 1 << 20, 16 << 20, 64 << 20 };
+    b->ArgNames({ "corpus", "bytes" });
+    for (int kind = 0; kind < bench_corpus_count; ++kind)
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+            b->Args({ kind, sizes[i] });
+}
+
+static void BM_u8to16(benchmark::State& state)
+{
+    const corpus& c = start(state);
+    for (auto _ : state)
+    {
+        std::u16string r = u8to16(c.utf8.data(), c.utf8.size(), false);
+        benchmark::DoNotOptimize(r.data());
+    }
+    set_processed(state, c);
+}
+BENCHMARK(BM_u8to16)->Apply(corpus_args);
+
+static void BM_u8to16_into(benchmark::State& state)
+{
+    const corpus& c = start(state);
+    std::u16string out;
+    for (auto _ : state)
+    {
+        u8to16_into(c.utf8.data(), c.utf8.size(), out, true);
+        benchmark::DoNotOptimize(out.data());
+    }
+    set_processed(state, c);
+}
+BENCHMARK(BM_u8to16_into)->Apply(corpus_args);
+
+static void BM_u8to16_length(benchmark::State& state)
+{
+    const corpus& c = start(state);
+    for (auto _ : state)
+        benchmark::DoNotOptimize(u8to16_length(c.utf8.data(), c.utf8.size()));
+    set_processed(state, c);
+}
+BENCHMARK(BM_u8to16_length)->Apply(corpus_args);
+
+static void BM_u16to8(benchmark::State& state)
+{
+    const corpus& c = start(state);
+    for (auto _ : state)
+    {
+        std::string r = u16to8(c.utf16.data(), c.utf16.size(), false);
+        benchmark::DoNotOptimize(r.data());
+    }
+    set_processed(state, c);
+}
+BENCHMARK(BM_u16to8)->Apply(corpus_args);
+
+static void BM_u16to8_into(benchmark::State& state)
+{
+    const corpus& c = start(state);
+    std::string out;
+    for (auto _ : state)
+    {
+        u16to8_into(c.utf16.data(), c.utf16.size(), out, true);
+        benchmark::DoNotOptimize(out.data());
+    }
+    set_processed(state, c);
+}
+BENCHMARK(BM_u16to8_into)->Apply(corpus_args);
+
+static void BM_u16to8_length(benchmark::State& state)
+{
+    const corpus& c = start(state);
+    for (auto _ : state)
+        benchmark::DoNotOptimize(u16to8_length(c.utf16.data(), c.utf16.size()));
+    set_processed(state, c);
+}
+BENCHMARK(BM_u16to8_length)->Apply(corpus_args);
+
+static void BM_u8to32(benchmark::State& state)
+{
+    const corpus& c = start(state);
+    for (auto _ : state)
+    {
+        std::u32string r = u8to32(c.utf8.data(), c.utf8.size(), false);
+        benchmark::DoNotOptimize(r.data());
+    }
+    set_processed(state, c);
+}
+BENCHMARK(BM_u8to32)->Apply(corpus_args);
+
+static void BM_u8to32_into(benchmark::State& state)
+{
+    const corpus& c = start(state);
+    std::u32string out;
+    for (auto _ : state)
+    {
+        u8to32_into(c.utf8.data(), c.utf8.size(), out, true);
+        benchmark::DoNotOptimize(out.data());
+    }
+    set_processed(state, c);
+}
+BENCHMARK(BM_u8to32_into)->Apply(corpus_args);
+
+// u8to16 followed by decoding the surrogate pairs, which u8to32_into replaces
+static void BM_u8to16_then_32(benchmark::State& state)
+{
+    const corpus& c = start(state);
+    std::u16string utf16;
+    std::u32string out;
+    for (auto _ : state)
+    {
+        u8to16_into(c.utf8.data(), c.utf8.size(), utf16, true);
+        out.clear();
+        for (size_t i = 0; i < utf16.size(); ++i)
+        {
+            char32_t u = utf16[i];
+            if ((u & 0xfc00) == 0xd800 && i + 1 < utf16.size())
+                u = 0x10000 + ((u - 0xd800) << 10) + (utf16[++i] - 0xdc00);
+            out += u;
+        }
+        benchmark::DoNotOptimize(out.data());
+    }
+    set_processed(state, c);
+}
+BENCHMARK(BM_u8to16_then_32)->Apply(corpus_args);
+
+static void BM_u32to8(benchmark::State& state)
+{
+    const corpus& c = start(state);
+    std::string out;
+    for (auto _ : state)
+    {
+        u32to8_into(c.utf32.data(), c.utf32.size(), out, true);
+        benchmark::DoNotOptimize(out.data());
+    }
+    set_processed(state, c);
+}
+BENCHMARK(BM_u32to8)->Apply(corpus_args);
+
+static void BM_u16to32(benchmark::State& state)
+{
+    const corpus& c = start(state);
+    std::u32string out;
+    for (auto _ : state)
+    {
+        u16to32_into(c.utf16.data(), c.utf16.size(), out, true);
+        benchmark::DoNotOptimize(out.data());
+    }
+    set_processed(state, c);
+}
+BENCHMARK(BM_u16to32)->Apply(corpus_args);
+
+static void BM_u32to16(benchmark::State& state)
+{
+    const corpus& c = start(state);
+    std::u16string out;
+    for (auto _ : state)
+    {
+        u32to16_into(c.utf32.data(), c.utf32.size(), out, true);
+        benchmark::DoNotOptimize(out.data());
+    }
+    set_processed(state, c);
+}
+BENCHMARK(BM_u32to16)->Apply(corpus_args);
+
+#ifdef _WIN32
+
+static void BM_u8widen(benchmark::State& state)
+{
+    const corpus& c = start(state);
+    for (auto _ : state)
+    {
+        std::wstring r = u8widen(c.utf8.data(), c.utf8.size(), false);
+        benchmark::DoNotOptimize(r.data());
+    }
+    set_processed(state, c);
+}
+BENCHMARK(BM_u8widen)->Apply(corpus_args);
+
+static void BM_u8narrow(benchmark::State& state)
+{
+    const corpus& c = start(state);
+    const wchar_t* s = reinterpret_cast<const wchar_t*>(c.utf16.data());
+    for (auto _ : state)
+    {
+        std::string r = u8narrow(s, c.utf16.size(), false);
+        benchmark::DoNotOptimize(r.data());
+    }
+    set_processed(state, c);
+}
+BENCHMARK(BM_u8narrow)->Apply(corpus_args);
+
+#endif
+
+static void set_paths_processed(benchmark::State& state, const std::vector<std::string>& paths)
+{
+    size_t bytes = 0;
+    size_t chars = 0;
+    for (size_t i = 0; i < paths.size(); ++i)
+    {
+        bytes += paths[i].size();
+        chars += count_chars(u8to16(paths[i]));
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * int64_t(bytes));
+    state.counters["chars/s"] = benchmark::Counter(double(state.iterations()) * double(chars), benchmark::Counter::kIsRate);
+}
+
+// converts short strings one by one, like u8widen(argv[1])
+static void BM_u8to16_paths(benchmark::State& state)
+{
+    std::vector<std::string> paths = make_paths(10000, 1);
+    for (auto _ : state)
+    {
+        for (size_t i = 0; i < paths.size(); ++i)
+        {
+            std::u16string r = u8to16(paths[i]);
+            benchmark::DoNotOptimize(r.data());
+        }
+    }
+    set_paths_processed(state, paths);
+}
+BENCHMARK(BM_u8to16_paths);
+
+static void BM_native_path(benchmark::State& state)
+{
+    std::vector<std::string> paths = make_paths(10000, 1);
+    for (auto _ : state)
+    {
+        for (size_t i = 0; i < paths.size(); ++i)
+        {
+            U8NativePath path(paths[i]);
+            benchmark::DoNotOptimize(path.c_str());
+        }
+    }
+    set_paths_processed(state, paths);
+}
+BENCHMARK(BM_native_path);
+
+// stops at the first invalid sequence, so the invalid corpus only measures how fast it is found
+static void BM_u8validate(benchmark::State& state)
+{
+    const corpus& c = start(state);
+    for (auto _ : state)
+        benchmark::DoNotOptimize(u8validate(c.utf8.data(), c.utf8.size()));
+    set_processed(state, c);
+}
+BENCHMARK(BM_u8validate)->Apply(corpus_args);
+
+static void BM_ostreambuf(benchmark::State& state)
+{
+    const corpus& c = start(state);
+    if (std::string(bench_corpora[c.kind]) == "invalid")
+    {
+        state.SkipWithError("the output buffer throws on invalid utf-8");
+        return;
+    }
+    std::u16string out;
+    U8ConsoleOstreamBuf<U8MemorySink> buf((U8MemorySink(out)));
+    std::ostream os(&buf);
+    for (auto _ : state)
+    {
+        os.write(c.utf8.data(), std::streamsize(c.utf8.size()));
+        os.flush();
+        benchmark::DoNotOptimize(out.data());
+        out.clear();
+    }
+    set_processed(state, c);
+}
+BENCHMARK(BM_ostreambuf)->Apply(corpus_args);
+
+static void BM_istreambuf(benchmark::State& state)
+{
+    const corpus& c = start(state);
+    std::vector<char> in(c.utf8.size() + 1);
+    for (auto _ : state)
+    {
+        U8ConsoleIstreamBuf<U8MemorySource> buf(U8MemorySource(c.utf16.data(), c.utf16.size()));
+        std::istream is(&buf);
+        is.read(&in[0], std::streamsize(in.size()));
+        benchmark::DoNotOptimize(is.gcount());
+    }
+    set_processed(state, c);
+}
+BENCHMARK(BM_istreambuf)->Apply(corpus_args);
+
+BENCHMARK_MAIN();
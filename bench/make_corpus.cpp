@@ -0,0 +1,55 @@
+/*
+Writes a benchmark corpus (see corpus.h) to stdout or a file, e.g.
+
+make_corpus multilingual 16777216 > multilingual.txt
+make_corpus paths 65536 7 paths.txt
+
+Build with cmake (target make_corpus), or for example:
+g++ -O2 make_corpus.cpp -o make_corpus
+*/
+
+#include "corpus.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+int main(int argc, char** argv)
+{
+    std::vector<std::string> names = corpus_names();
+    bool known = false;
+    for (size_t i = 0; argc > 1 && i < names.size(); ++i)
+        known = known || names[i] == argv[1];
+    if (argc < 3 || argc > 5 || !known)
+    {
+        std::fprintf(stderr, "usage: make_corpus <corpus> <bytes> [seed] [file]\ncorpora:");
+        for (size_t i = 0; i < names.size(); ++i)
+            std::fprintf(stderr, " %s", names[i].c_str());
+        std::fprintf(stderr, "\n");
+        return 2;
+    }
+    size_t size = size_t(std::strtoull(argv[2], 0, 10));
+    uint32_t seed = argc > 3 ? uint32_t(std::strtoul(argv[3], 0, 10)) : 1;
+    std::string text = make_corpus(argv[1], size, seed);
+
+    // binary, so that the size is exact on every system
+    FILE* f = stdout;
+    if (argc > 4)
+        f = std::fopen(argv[4], "wb");
+#ifdef _WIN32
+    else
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    if (!f || std::fwrite(text.data(), 1, text.size(), f) != text.size() || std::fflush(f))
+    {
+        std::fprintf(stderr, "make_corpus: write failed\n");
+        return 1;
+    }
+    return 0;
+}
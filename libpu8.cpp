@@ -12,148 +12,2665 @@ Redistribution and use in source and binary forms, with or without modification,
 THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#include "libpu8.h"
+
+#include <cstdint>
+#include <cstdlib>
+#if LIBPU8_INSTRUMENT
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define LIBPU8_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define LIBPU8_TARGET(features)
+#else
+#include <cpuid.h>
+#define LIBPU8_TARGET(features) __attribute__((target(features)))
+#endif
+#else
+#define LIBPU8_X86 0
+#endif
+
+// The AVX-512 kernels need 64 bit mask registers, so they are only built for x86-64.
+// Define LIBPU8_NO_AVX512 for compilers that do not know AVX-512 VBMI2.
+#if LIBPU8_X86 && (defined(__x86_64__) || defined(_M_X64)) && !defined(LIBPU8_NO_AVX512)
+#define LIBPU8_AVX512 1
+#else
+#define LIBPU8_AVX512 0
+#endif
+
+#if LIBPU8_X86
+
+// Runtime cpu feature detection. The simd kernels are compiled for their instruction set
+// regardless of the compiler flags and are only called if the cpu (and the OS) supports them.
+
+enum
+{
+    U8CPU_SSE2 = 1,
+    U8CPU_AVX2 = 2,
+    U8CPU_AVX512 = 4, // AVX-512 F, BW, VL and VBMI2
+    U8CPU_SSSE3 = 8
+};
+
+static void u8_cpuid(unsigned leaf, unsigned subleaf, unsigned regs[4])
+{
+#ifdef _MSC_VER
+    int r[4];
+    __cpuidex(r, int(leaf), int(subleaf));
+    for (int i = 0; i < 4; ++i)
+        regs[i] = unsigned(r[i]);
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// which register states the OS saves on context switches
+static uint64_t u8_xgetbv()
+{
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    unsigned lo, hi;
+    __asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return (uint64_t(hi) << 32) | lo;
+#endif
+}
+
+// The environment variable LIBPU8_MAX_SIMD=none, sse2, ssse3 or avx2 keeps the kernels of the newer
+// instruction sets from being selected, so that the lower tiers can be tested and benchmarked on a
+// newer cpu.
+static unsigned u8_simd_limit()
+{
+#ifdef _MSC_VER
+#pragma warning(suppress : 4996) // getenv
+#endif
+    const char* limit = std::getenv("LIBPU8_MAX_SIMD");
+    if (!limit)
+        return ~0u;
+    if (!std::strcmp(limit, "none"))
+        return 0;
+    if (!std::strcmp(limit, "sse2"))
+        return U8CPU_SSE2;
+    if (!std::strcmp(limit, "ssse3"))
+        return U8CPU_SSE2 | U8CPU_SSSE3;
+    if (!std::strcmp(limit, "avx2"))
+        return U8CPU_SSE2 | U8CPU_SSSE3 | U8CPU_AVX2;
+    return ~0u;
+}
+
+static unsigned u8_cpu_features()
+{
+    unsigned regs[4];
+    u8_cpuid(0, 0, regs);
+    unsigned max_leaf = regs[0];
+    u8_cpuid(1, 0, regs);
+    unsigned features = 0;
+    if (regs[3] & (1u << 26))
+        features |= U8CPU_SSE2;
+    if (regs[2] & (1u << 9))
+        features |= U8CPU_SSSE3;
+    bool osxsave = (regs[2] & (1u << 27)) != 0;
+    bool avx = (regs[2] & (1u << 28)) != 0;
+    if (osxsave && avx && max_leaf >= 7)
+    {
+        uint64_t os_state = u8_xgetbv();
+        u8_cpuid(7, 0, regs);
+        // xmm and ymm state
+        if ((os_state & 6) == 6 && (regs[1] & (1u << 5)))
+            features |= U8CPU_AVX2;
+        // additionally opmask and zmm state
+        const unsigned avx512_ebx = (1u << 16) | (1u << 30) | (1u << 31); // F, BW, VL
+        if ((os_state & 0xE6) == 0xE6 && (regs[1] & avx512_ebx) == avx512_ebx && (regs[2] & (1u << 6)))
+            features |= U8CPU_AVX512;
+    }
+    return features & u8_simd_limit();
+}
+
+static inline unsigned u8_ctz(uint32_t x)
+{
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanForward(&i, x);
+    return unsigned(i);
+#else
+    return unsigned(__builtin_ctz(x));
+#endif
+}
+
+static inline unsigned u8_popcount64(uint64_t x)
+{
+#ifdef _MSC_VER
+    return unsigned(__popcnt(unsigned(x))) + unsigned(__popcnt(unsigned(x >> 32)));
+#else
+    return unsigned(__builtin_popcountll(x));
+#endif
+}
+
+#endif // LIBPU8_X86
+
+// Portable utf-8 <-> utf-16 engine.
+// utf-8 is decoded with a table driven state machine that accepts exactly the well-formed sequences
+// of the unicode standard (no overlongs, no surrogates, nothing above U+10FFFF).
+
+static const uint32_t u8_invalid_cp = 0xFFFFFFFF;
+static const char16_t u8_replacement_char = 0xFFFD;
+
+// byte classes
+// 0: 00..7F, 1: 80..8F, 2: 90..9F, 3: A0..BF, 4: C0..C1, 5: C2..DF, 6: E0,
+// 7: E1..EC and EE..EF, 8: ED, 9: F0, 10: F1..F3, 11: F4, 12: F5..FF
+static const unsigned char utf8_class[256] =
+{
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, 2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,
+    3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,
+    4,4,5,5,5,5,5,5,5,5,5,5,5,5,5,5, 5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,
+    6,7,7,7,7,7,7,7,7,7,7,7,7,8,7,7, 9,10,10,10,11,12,12,12,12,12,12,12,12,12,12,12
+};
+
+// bits of the leading byte that belong to the code point, by byte class
+static const unsigned char utf8_lead_mask[16] =
+{
+    0x7F, 0, 0, 0, 0, 0x1F, 0x0F, 0x0F, 0x0F, 0x07, 0x07, 0x07, 0, 0, 0, 0
+};
+
+// states
+enum
+{
+    U8S_ACCEPT = 0, // between code points
+    U8S_REJECT = 1,
+    U8S_CONT1 = 2,  // 1 more continuation byte
+    U8S_CONT2 = 3,  // 2 more continuation bytes
+    U8S_CONT3 = 4,  // 3 more continuation bytes
+    U8S_E0 = 5,     // after E0, next byte must be A0..BF
+    U8S_ED = 6,     // after ED, next byte must be 80..9F
+    U8S_F0 = 7,     // after F0, next byte must be 90..BF
+    U8S_F4 = 8      // after F4, next byte must be 80..8F
+};
+
+// next state, indexed by state * 16 + byte class
+static const unsigned char utf8_transition[9 * 16] =
+{
+    // ACCEPT
+    0, 1, 1, 1, 1, 2, 5, 3, 6, 7, 4, 8, 1, 1, 1, 1,
+    // REJECT
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    // CONT1
+    1, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    // CONT2
+    1, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    // CONT3
+    1, 3, 3, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    // E0
+    1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    // ED
+    1, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    // F0
+    1, 1, 3, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    // F4
+    1, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1
+};
+
+// Decodes the code point that starts at p (p < end) and advances p past it.
+// If the sequence is invalid, returns u8_invalid_cp and advances p past the maximal
+// subpart of the invalid sequence, which is at least one byte.
+static inline uint32_t decode_utf8(const unsigned char*& p, const unsigned char* end)
+{
+    unsigned char b = *p++;
+    if (b < 0x80)
+        return b;
+    unsigned type = utf8_class[b];
+    unsigned state = utf8_transition[type];
+    uint32_t cp = b & utf8_lead_mask[type];
+    while (state > U8S_REJECT)
+    {
+        if (p == end)
+            return u8_invalid_cp;
+        b = *p;
+        state = utf8_transition[state * 16 + utf8_class[b]];
+        if (state == U8S_REJECT)
+            return u8_invalid_cp; // b may start the next sequence
+        cp = (cp << 6) | (b & 0x3F);
+        ++p;
+    }
+    if (state == U8S_REJECT)
+        return u8_invalid_cp;
+    return cp;
+}
+
+// Kernels that convert a prefix of the utf-8 in [p, end) to utf-16 or utf-32 (Char) and advance
+// p and o past it. They stop in front of anything they do not handle, which is at least invalid
+// input, and may convert nothing at all. o must have room for end - p code units. Within that
+// room, kernels may write garbage beyond the code units they report.
+template <class Char>
+using widen_kernel = void (*)(const unsigned char*& p, const unsigned char* end, Char*& o);
+
+template <class Char>
+static void widen_ascii_scalar(const unsigned char*& p, const unsigned char* end, Char*& o)
+{
+    while (p < end && *p < 0x80)
+        *o++ = *p++;
+}
+
+#if LIBPU8_X86
+
+// store the 16 bytes of v as 16 code units
+LIBPU8_TARGET("sse2")
+static inline void widen_store_sse2(char16_t* o, __m128i v)
+{
+    const __m128i zero = _mm_setzero_si128();
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(o), _mm_unpacklo_epi8(v, zero));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(o + 8), _mm_unpackhi_epi8(v, zero));
+}
+
+LIBPU8_TARGET("sse2")
+static inline void widen_store_sse2(char32_t* o, __m128i v)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_unpacklo_epi8(v, zero), hi = _mm_unpackhi_epi8(v, zero);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(o), _mm_unpacklo_epi16(lo, zero));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(o + 4), _mm_unpackhi_epi16(lo, zero));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(o + 8), _mm_unpacklo_epi16(hi, zero));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(o + 12), _mm_unpackhi_epi16(hi, zero));
+}
+
+template <class Char>
+LIBPU8_TARGET("sse2")
+static void widen_ascii_sse2(const unsigned char*& p, const unsigned char* end, Char*& o)
+{
+    while (end - p >= 16)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        widen_store_sse2(o, v);
+        unsigned non_ascii = unsigned(_mm_movemask_epi8(v));
+        if (non_ascii)
+        {
+            unsigned n = u8_ctz(non_ascii);
+            p += n;
+            o += n;
+            return;
+        }
+        p += 16;
+        o += 16;
+    }
+}
+
+// Shuffle tables for converting 12 bytes of utf-8 at once, in the style of simdutf.
+// The key is a 12 bit mask that has bit i set if byte i is the last byte of a code point.
+// Patterns 0..63 place 6 code points of 1 or 2 bytes into the 16 bit lanes of a register,
+// patterns 64..144 place 4 code points of 1 to 3 bytes into 32 bit lanes. Each lane holds the
+// bytes of a code point in reverse order (last byte in the lowest byte) and is zero-padded.
+struct utf8_to_utf16_tables
+{
+    enum { NUM_6X2 = 64, NUM_PATTERNS = 64 + 81, NO_PATTERN = 255 };
+
+    unsigned char pattern[4096];
+    unsigned char consumed[4096];
+    unsigned char shuffle[NUM_PATTERNS][16];
+
+    utf8_to_utf16_tables()
+    {
+        for (unsigned mask = 0; mask < 4096; ++mask)
+        {
+            unsigned start[12], length[12], n = 0, first = 0;
+            for (unsigned i = 0; i < 12; ++i)
+            {
+                if (mask & (1u << i))
+                {
+                    start[n] = first;
+                    length[n++] = i - first + 1;
+                    first = i + 1;
+                }
+            }
+            pattern[mask] = NO_PATTERN;
+            consumed[mask] = 0;
+            unsigned k = 0;
+            while (k < n && k < 6 && length[k] <= 2)
+                ++k;
+            if (k == 6)
+            {
+                unsigned index = 0;
+                for (unsigned j = 0; j < 6; ++j)
+                    index |= (length[j] - 1) << j;
+                for (unsigned j = 0; j < 8; ++j)
+                {
+                    bool used = j < 6;
+                    shuffle[index][2 * j] = (unsigned char)(used ? start[j] + length[j] - 1 : 0x80);
+                    shuffle[index][2 * j + 1] = (unsigned char)(used && length[j] == 2 ? start[j] : 0x80);
+                }
+                pattern[mask] = (unsigned char)index;
+                consumed[mask] = (unsigned char)(start[5] + length[5]);
+                continue;
+            }
+            k = 0;
+            while (k < n && k < 4 && length[k] <= 3)
+                ++k;
+            if (k == 4)
+            {
+                unsigned index = 0;
+                for (unsigned j = 4; j-- > 0;)
+                    index = index * 3 + length[j] - 1;
+                index += NUM_6X2;
+                for (unsigned j = 0; j < 4; ++j)
+                {
+                    unsigned last = start[j] + length[j] - 1;
+                    for (unsigned b = 0; b < 4; ++b)
+                        shuffle[index][4 * j + b] = (unsigned char)(b < length[j] ? last - b : 0x80);
+                }
+                pattern[mask] = (unsigned char)index;
+                consumed[mask] = (unsigned char)(start[3] + length[3]);
+            }
+        }
+    }
+};
+
+// store the 16 bytes of v as 16 code units
+LIBPU8_TARGET("avx2")
+static inline void widen_store_avx2(char16_t* o, __m128i v)
+{
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(o), _mm256_cvtepu8_epi16(v));
+}
+
+LIBPU8_TARGET("avx2")
+static inline void widen_store_avx2(char32_t* o, __m128i v)
+{
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(o), _mm256_cvtepu8_epi32(v));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(o + 8), _mm256_cvtepu8_epi32(_mm_srli_si128(v, 8)));
+}
+
+// store the code points in the 16 bit lanes (8) or the 32 bit lanes (4) of cp
+LIBPU8_TARGET("avx2")
+static inline void widen_store_16_avx2(char16_t* o, __m128i cp)
+{
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(o), cp);
+}
+
+LIBPU8_TARGET("avx2")
+static inline void widen_store_16_avx2(char32_t* o, __m128i cp)
+{
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(o), _mm256_cvtepu16_epi32(cp));
+}
+
+LIBPU8_TARGET("avx2")
+static inline void widen_store_32_avx2(char16_t* o, __m128i cp)
+{
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(o), _mm_packus_epi32(cp, cp));
+}
+
+LIBPU8_TARGET("avx2")
+static inline void widen_store_32_avx2(char32_t* o, __m128i cp)
+{
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(o), cp);
+}
+
+// Converts 1, 2 and 3 byte sequences; leaves 4 byte sequences and invalid input to the caller.
+// Blocks of 64 bytes are classified at once. Within a block, 12 byte windows are converted with
+// the shuffle tables, or 16 bytes at once if they are ascii.
+template <class Char>
+LIBPU8_TARGET("avx2")
+static void widen_avx2(const unsigned char*& p, const unsigned char* end, Char*& o)
+{
+    static const utf8_to_utf16_tables tables;
+    const __m256i cont_limit = _mm256_set1_epi8(-64); // continuation bytes are less, as signed char
+    const __m128i mask_7f = _mm_set1_epi16(0x7F);
+    const __m128i mask_1f00 = _mm_set1_epi16(0x1F00);
+    const __m128i c2_min = _mm_set1_epi16(0x3E00);   // adding it subtracts 0xC200
+    const __m128i c2_range = _mm_set1_epi16(0x1DFF); // 0xDFFF - 0xC200
+    const __m128i mask_3f00 = _mm_set1_epi32(0x3F00);
+    const __m128i mask_0f0000 = _mm_set1_epi32(0x0F0000);
+    while (end - p >= 64)
+    {
+        __m256i v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        __m256i v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32));
+        uint64_t non_ascii = uint32_t(_mm256_movemask_epi8(v0)) | (uint64_t(uint32_t(_mm256_movemask_epi8(v1))) << 32);
+        if (!non_ascii)
+        {
+            widen_store_avx2(o, _mm256_castsi256_si128(v0));
+            widen_store_avx2(o + 16, _mm256_extracti128_si256(v0, 1));
+            widen_store_avx2(o + 32, _mm256_castsi256_si128(v1));
+            widen_store_avx2(o + 48, _mm256_extracti128_si256(v1, 1));
+            p += 64;
+            o += 64;
+            continue;
+        }
+        uint64_t cont = uint32_t(_mm256_movemask_epi8(_mm256_cmpgt_epi8(cont_limit, v0)))
+            | (uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpgt_epi8(cont_limit, v1)))) << 32);
+        // bit i: byte i is the last byte of a code point. Bit 63 depends on the next block
+        // and is not used, because windows start at 48 at the latest.
+        uint64_t ends = ~(cont >> 1);
+        unsigned pos = 0;
+        while (pos <= 48)
+        {
+            __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + pos));
+            if (!((non_ascii >> pos) & 0xFFFF))
+            {
+                widen_store_avx2(o, in);
+                pos += 16;
+                o += 16;
+                continue;
+            }
+            unsigned key = unsigned(ends >> pos) & 0xFFF;
+            unsigned index = tables.pattern[key];
+            if (index < unsigned(utf8_to_utf16_tables::NUM_6X2))
+            {
+                __m128i lanes = _mm_shuffle_epi8(in, _mm_loadu_si128(reinterpret_cast<const __m128i*>(tables.shuffle[index])));
+                // valid lanes are ascii (< 0x80) or 2 byte sequences with a leading byte of C2..DF
+                __m128i ascii_ok = _mm_cmpeq_epi16(_mm_min_epu16(lanes, mask_7f), lanes);
+                __m128i rel = _mm_add_epi16(lanes, c2_min);
+                __m128i two_ok = _mm_cmpeq_epi16(_mm_min_epu16(rel, c2_range), rel);
+                if ((_mm_movemask_epi8(_mm_or_si128(ascii_ok, two_ok)) & 0xFFF) != 0xFFF)
+                    break;
+                __m128i cp = _mm_or_si128(_mm_and_si128(lanes, mask_7f), _mm_srli_epi16(_mm_and_si128(lanes, mask_1f00), 2));
+                widen_store_16_avx2(o, cp);
+                o += 6;
+            }
+            else if (index != unsigned(utf8_to_utf16_tables::NO_PATTERN))
+            {
+                __m128i lanes = _mm_shuffle_epi8(in, _mm_loadu_si128(reinterpret_cast<const __m128i*>(tables.shuffle[index])));
+                // valid lanes are ascii, C2..DF followed by 1 continuation byte, E0 A0..BF, E1..EC, ED 80..9F
+                // or EE..EF, each followed by 1 more continuation byte
+                __m128i ok = _mm_cmpgt_epi32(_mm_set1_epi32(0x80), lanes);
+                ok = _mm_or_si128(ok, _mm_and_si128(_mm_cmpgt_epi32(lanes, _mm_set1_epi32(0xC1FF)),
+                    _mm_cmpgt_epi32(_mm_set1_epi32(0xE000), lanes)));
+                ok = _mm_or_si128(ok, _mm_and_si128(_mm_cmpgt_epi32(lanes, _mm_set1_epi32(0xE09FFF)),
+                    _mm_cmpgt_epi32(_mm_set1_epi32(0xEDA000), lanes)));
+                ok = _mm_or_si128(ok, _mm_and_si128(_mm_cmpgt_epi32(lanes, _mm_set1_epi32(0xEDFFFF)),
+                    _mm_cmpgt_epi32(_mm_set1_epi32(0xF00000), lanes)));
+                if (_mm_movemask_epi8(ok) != 0xFFFF)
+                    break;
+                __m128i cp = _mm_or_si128(_mm_and_si128(lanes, _mm_set1_epi32(0x7F)),
+                    _mm_or_si128(_mm_srli_epi32(_mm_and_si128(lanes, mask_3f00), 2),
+                        _mm_srli_epi32(_mm_and_si128(lanes, mask_0f0000), 4)));
+                widen_store_32_avx2(o, cp);
+                o += 4;
+            }
+            else
+                break; // 4 byte sequence or invalid input
+            pos += tables.consumed[key];
+        }
+        if (pos <= 48)
+        {
+            // still convert the ascii bytes in front of the sequence that stopped the kernel, so
+            // that the scalar code starts right at it
+            unsigned ascii = u8_ctz(uint32_t(non_ascii >> pos));
+            widen_store_avx2(o, _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + pos)));
+            p += pos + ascii;
+            o += ascii;
+            return;
+        }
+        p += pos;
+    }
+    // ascii tail
+    while (end - p >= 16)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        if (_mm_movemask_epi8(v))
+            return;
+        widen_store_avx2(o, v);
+        p += 16;
+        o += 16;
+    }
+}
+
+#endif // LIBPU8_X86
+
+#if LIBPU8_AVX512
+
+// gcc 12 warns about the _mm*_undefined values inside its own AVX-512 intrinsics
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+// Converts 1, 2 and 3 byte sequences 32 bytes at a time; leaves 4 byte sequences and invalid input
+// to the caller. Every byte of the block is decoded as if it started a code point, using the two
+// following bytes where needed, and the code points that really start there are compressed into
+// contiguous utf-16 with vpcompressw.
+LIBPU8_TARGET("avx512f,avx512bw,avx512vl,avx512vbmi2,popcnt")
+static void widen_avx512(const unsigned char*& p, const unsigned char* end, char16_t*& o)
+{
+    const __m512i cont_limit = _mm512_set1_epi8(-64); // continuation bytes are less, as signed char
+    const __m512i mask_3f = _mm512_set1_epi16(0x3F);
+    while (end - p >= 64)
+    {
+        __m512i v = _mm512_loadu_si512(p);
+        uint64_t non_ascii = _mm512_movepi8_mask(v);
+        if (!non_ascii)
+        {
+            _mm512_storeu_si512(o, _mm512_cvtepu8_epi16(_mm512_castsi512_si256(v)));
+            _mm512_storeu_si512(o + 32, _mm512_cvtepu8_epi16(_mm512_extracti64x4_epi64(v, 1)));
+            p += 64;
+            o += 64;
+            continue;
+        }
+        __m512i b0 = _mm512_cvtepu8_epi16(_mm512_castsi512_si256(v));
+        if (!(non_ascii & 0xFFFFFFFF))
+        {
+            _mm512_storeu_si512(o, b0);
+            p += 32;
+            o += 32;
+            continue;
+        }
+        __m512i b1 = _mm512_cvtepu8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 1)));
+        __m512i b2 = _mm512_cvtepu8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 2)));
+        uint64_t cont = _mm512_cmplt_epi8_mask(v, cont_limit);
+        uint64_t cont1 = cont >> 1, cont2 = cont >> 2, cont3 = cont >> 3;
+        uint32_t one = _mm512_cmplt_epu16_mask(b0, _mm512_set1_epi16(0x80));
+        uint32_t two = _mm512_cmplt_epu16_mask(_mm512_sub_epi16(b0, _mm512_set1_epi16(0xC2)), _mm512_set1_epi16(0xE0 - 0xC2));
+        uint32_t three = _mm512_cmplt_epu16_mask(_mm512_sub_epi16(b0, _mm512_set1_epi16(0xE0)), _mm512_set1_epi16(0x10));
+        // each code point must be followed by exactly as many continuation bytes as its leading
+        // byte announces, and the block must not start with a continuation byte
+        uint32_t leads = ~uint32_t(cont);
+        uint32_t well_formed = (one & ~uint32_t(cont1)) | (two & uint32_t(cont1 & ~cont2))
+            | (three & uint32_t(cont1 & cont2 & ~cont3));
+        if (well_formed != leads || (cont & 1))
+            break;
+        __m512i cp2 = _mm512_or_si512(_mm512_slli_epi16(_mm512_and_si512(b0, _mm512_set1_epi16(0x1F)), 6),
+            _mm512_and_si512(b1, mask_3f));
+        __m512i cp3 = _mm512_or_si512(_mm512_slli_epi16(_mm512_and_si512(b0, _mm512_set1_epi16(0x0F)), 12),
+            _mm512_or_si512(_mm512_slli_epi16(_mm512_and_si512(b1, mask_3f), 6), _mm512_and_si512(b2, mask_3f)));
+        // 3 byte sequences must not be overlong or encode surrogates
+        uint32_t bad = _mm512_mask_cmplt_epu16_mask(three, cp3, _mm512_set1_epi16(0x800))
+            | _mm512_mask_cmpeq_epi16_mask(three, _mm512_and_si512(cp3, _mm512_set1_epi16(-0x800)), _mm512_set1_epi16(-0x2800));
+        if (bad)
+            break;
+        __m512i cp = _mm512_mask_blend_epi16(three, _mm512_mask_blend_epi16(two, b0, cp2), cp3);
+        _mm512_storeu_si512(o, _mm512_maskz_compress_epi16(leads, cp));
+        o += u8_popcount64(leads);
+        // the last code point may extend into the next block
+        p += 32 + ((cont >> 32) & 1) + ((cont >> 32) & (cont >> 33) & 1);
+    }
+    // stopped by a 4 byte sequence or invalid input in the first 32 bytes: still convert the ascii
+    // bytes in front of it, as widen_avx2 does
+    if (end - p >= 64)
+    {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        unsigned ascii = u8_ctz(uint32_t(_mm256_movemask_epi8(v)));
+        _mm512_storeu_si512(o, _mm512_cvtepu8_epi16(v));
+        p += ascii;
+        o += ascii;
+        return;
+    }
+    // the last 0 to 63 bytes: convert their ascii prefix with masked loads and stores, which do not
+    // touch memory behind end, so short strings do not fall back to the scalar loop
+    if (p == end)
+        return;
+    uint64_t in_range = ~uint64_t(0) >> (64 - (end - p));
+    __m512i v = _mm512_maskz_loadu_epi8(in_range, p);
+    uint64_t non_ascii = _mm512_movepi8_mask(v);
+    uint64_t ascii = in_range & (non_ascii - 1) & ~non_ascii;
+    _mm512_mask_storeu_epi16(o, __mmask32(ascii), _mm512_cvtepu8_epi16(_mm512_castsi512_si256(v)));
+    _mm512_mask_storeu_epi16(o + 32, __mmask32(ascii >> 32), _mm512_cvtepu8_epi16(_mm512_extracti64x4_epi64(v, 1)));
+    unsigned n = u8_popcount64(ascii);
+    p += n;
+    o += n;
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#endif // LIBPU8_AVX512
+
+template <class Char>
+static widen_kernel<Char> select_widen_kernel();
+
+template <>
+widen_kernel<char16_t> select_widen_kernel<char16_t>()
+{
+#if LIBPU8_X86
+    unsigned features = u8_cpu_features();
+#if LIBPU8_AVX512
+    if (features & U8CPU_AVX512)
+        return widen_avx512;
+#endif
+    if (features & U8CPU_AVX2)
+        return widen_avx2<char16_t>;
+    if (features & U8CPU_SSE2)
+        return widen_ascii_sse2<char16_t>;
+#endif
+    return widen_ascii_scalar<char16_t>;
+}
+
+// utf-32 has no AVX-512 kernel
+template <>
+widen_kernel<char32_t> select_widen_kernel<char32_t>()
+{
+#if LIBPU8_X86
+    unsigned features = u8_cpu_features();
+    if (features & U8CPU_AVX2)
+        return widen_avx2<char32_t>;
+    if (features & U8CPU_SSE2)
+        return widen_ascii_sse2<char32_t>;
+#endif
+    return widen_ascii_scalar<char32_t>;
+}
+
+static u8_conversion_result u8_make_result(u8_conversion_status status, size_t input_consumed,
+    size_t output_written, size_t error_offset)
+{
+    u8_conversion_result result;
+    result.status = status;
+    result.input_consumed = input_consumed;
+    result.output_written = output_written;
+    result.error_offset = error_offset;
+    return result;
+}
+
+#if LIBPU8_INSTRUMENT
+
+// Indices of the counters. Each call counter is followed by input, output, errors and nanoseconds.
+enum
+{
+    u8_counter_to16 = 0,
+    u8_counter_to8 = 5,
+    u8_counter_validate = 10,
+    u8_counter_to32 = 15,
+    u8_counter_from32 = 20,
+    u8_counter_exception = 25,
+    u8_counter_sink_write,
+    u8_counter_source_read,
+    u8_counter_count
+};
+
+// The counters of one thread. Only the owning thread changes them, so relaxed loads and stores
+// suffice while u8_get_stats reads them from another thread.
+struct u8_thread_counters
+{
+    u8_thread_counters();
+    ~u8_thread_counters();
+    void add(unsigned i, unsigned long long n)
+    {
+        values[i].store(values[i].load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    std::atomic<unsigned long long> values[u8_counter_count];
+};
+
+// The counters of the running threads, the sums of the finished threads, and the totals at the
+// last reset.
+struct u8_stats_registry
+{
+    u8_stats_registry() : finished(), reset() {}
+    std::mutex mutex;
+    std::vector<u8_thread_counters*> threads;
+    unsigned long long finished[u8_counter_count];
+    unsigned long long reset[u8_counter_count];
+};
+
+static u8_stats_registry& u8_registry()
+{
+    static u8_stats_registry registry;
+    return registry;
+}
+
+u8_thread_counters::u8_thread_counters()
+{
+    for (unsigned i = 0; i < u8_counter_count; ++i)
+        values[i].store(0, std::memory_order_relaxed);
+    u8_stats_registry& registry = u8_registry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.threads.push_back(this);
+}
+
+u8_thread_counters::~u8_thread_counters()
+{
+    u8_stats_registry& registry = u8_registry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for (unsigned i = 0; i < u8_counter_count; ++i)
+        registry.finished[i] += values[i].load(std::memory_order_relaxed);
+    registry.threads.erase(std::find(registry.threads.begin(), registry.threads.end(), this));
+}
+
+static u8_thread_counters& u8_counters()
+{
+    static thread_local u8_thread_counters counters;
+    return counters;
+}
+
+// measures a call from its construction to record
+struct u8_call_timer
+{
+    u8_call_timer() : start(std::chrono::steady_clock::now()) {}
+    void record(unsigned counter, size_t input, size_t output, bool error) const
+    {
+        std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - start;
+        u8_thread_counters& counters = u8_counters();
+        counters.add(counter, 1);
+        counters.add(counter + 1, input);
+        counters.add(counter + 2, output);
+        counters.add(counter + 3, error);
+        counters.add(counter + 4, (unsigned long long)elapsed.count());
+    }
+    std::chrono::steady_clock::time_point start;
+};
+
+#endif // LIBPU8_INSTRUMENT
+
+// Converts len bytes of utf-8 to utf-16 or utf-32 (Char) into out, which has room for
+// out_capacity code units. Stops at the first invalid sequence unless replace_inv_chars is true,
+// in which case invalid sequences are replaced by U+FFFD. Stops in front of the first code point
+// that does not fit. Bounded is false if out_capacity >= len, which skips the room checks.
+template <class Char, bool Bounded>
+static u8_conversion_result convert_from_utf8(const char* s, size_t len, Char* out, size_t out_capacity,
+    bool replace_inv_chars)
+{
+    static const widen_kernel<Char> widen = select_widen_kernel<Char>();
+    const unsigned char* begin = reinterpret_cast<const unsigned char*>(s);
+    const unsigned char* p = begin;
+    const unsigned char* end = p + len;
+    Char* o = out;
+    Char* o_end = out + out_capacity;
+    while (p < end)
+    {
+        // the kernel writes at most as many code units as it reads bytes
+        size_t room = size_t(o_end - o);
+        widen(p, !Bounded || size_t(end - p) <= room ? end : p + room, o);
+        // continue with whatever the kernel left, for at least 16 bytes
+        const unsigned char* scalar_end = end - p > 16 ? p + 16 : end;
+        while (p < scalar_end)
+        {
+            const unsigned char* seq = p;
+            if (*p < 0x80)
+            {
+                if (Bounded && o == o_end)
+                    goto output_full;
+                *o++ = *p++;
+                continue;
+            }
+            uint32_t cp = decode_utf8(p, end);
+            if (cp == u8_invalid_cp)
+            {
+                if (!replace_inv_chars)
+                    return u8_make_result(u8_conversion_status::invalid_input, size_t(p - begin), size_t(o - out),
+                        size_t(seq - begin));
+                cp = u8_replacement_char;
+                // an invalid byte in ascii text: give the ascii behind it back to the kernel
+                if (p < end && *p < 0x80)
+                    scalar_end = p;
+            }
+            if (cp < 0x10000 || sizeof(Char) == 4)
+            {
+                if (Bounded && o == o_end)
+                {
+                    p = seq;
+                    goto output_full;
+                }
+                *o++ = Char(cp);
+            }
+            else
+            {
+                if (Bounded && o_end - o < 2)
+                {
+                    p = seq;
+                    goto output_full;
+                }
+                cp -= 0x10000;
+                *o++ = char16_t(0xD800 + (cp >> 10));
+                *o++ = char16_t(0xDC00 + (cp & 0x3FF));
+            }
+        }
+    }
+    return u8_make_result(u8_conversion_status::ok, len, size_t(o - out), len);
+output_full:
+    return u8_make_result(u8_conversion_status::output_too_small, size_t(p - begin), size_t(o - out),
+        size_t(p - begin));
+}
+
+// convert_from_utf8, counted if LIBPU8_INSTRUMENT is 1
+template <bool Bounded>
+static u8_conversion_result utf8_to_utf16(const char* s, size_t len, char16_t* out, size_t out_capacity,
+    bool replace_inv_chars)
+{
+#if LIBPU8_INSTRUMENT
+    u8_call_timer timer;
+    u8_conversion_result result = convert_from_utf8<char16_t, Bounded>(s, len, out, out_capacity, replace_inv_chars);
+    timer.record(u8_counter_to16, result.input_consumed, result.output_written,
+        result.status == u8_conversion_status::invalid_input);
+    return result;
+#else
+    return convert_from_utf8<char16_t, Bounded>(s, len, out, out_capacity, replace_inv_chars);
+#endif
+}
+
+template <bool Bounded>
+static u8_conversion_result utf8_to_utf32(const char* s, size_t len, char32_t* out, size_t out_capacity,
+    bool replace_inv_chars)
+{
+#if LIBPU8_INSTRUMENT
+    u8_call_timer timer;
+    u8_conversion_result result = convert_from_utf8<char32_t, Bounded>(s, len, out, out_capacity, replace_inv_chars);
+    timer.record(u8_counter_to32, result.input_consumed, result.output_written,
+        result.status == u8_conversion_status::invalid_input);
+    return result;
+#else
+    return convert_from_utf8<char32_t, Bounded>(s, len, out, out_capacity, replace_inv_chars);
+#endif
+}
+
+// Kernels that convert a prefix of the utf-16 or utf-32 (Char) in [p, end) to utf-8 and advance
+// p and o past it, analogous to the widen kernels. o must have room for 3 * (end - p) bytes.
+template <class Char>
+using narrow_kernel = void (*)(const Char*& p, const Char* end, unsigned char*& o);
+
+template <class Char>
+static void narrow_ascii_scalar(const Char*& p, const Char* end, unsigned char*& o)
+{
+    while (p < end && *p < 0x80)
+        *o++ = (unsigned char)*p++;
+}
+
+#if LIBPU8_X86
+
+// loads 8 code units into 16 bit lanes. utf-32 is saturated, which keeps ascii and non-ascii apart.
+LIBPU8_TARGET("sse2")
+static inline __m128i narrow_load_sse2(const char16_t* p)
+{
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+}
+
+LIBPU8_TARGET("sse2")
+static inline __m128i narrow_load_sse2(const char32_t* p)
+{
+    return _mm_packs_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)),
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 4)));
+}
+
+template <class Char>
+LIBPU8_TARGET("sse2")
+static void narrow_ascii_sse2(const Char*& p, const Char* end, unsigned char*& o)
+{
+    const __m128i non_ascii_bits = _mm_set1_epi16(-0x80); // 0xFF80
+    const __m128i zero = _mm_setzero_si128();
+    while (end - p >= 16)
+    {
+        __m128i v0 = narrow_load_sse2(p);
+        __m128i v1 = narrow_load_sse2(p + 8);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(o), _mm_packus_epi16(v0, v1));
+        __m128i ascii0 = _mm_cmpeq_epi16(_mm_and_si128(v0, non_ascii_bits), zero);
+        __m128i ascii1 = _mm_cmpeq_epi16(_mm_and_si128(v1, non_ascii_bits), zero);
+        unsigned non_ascii = ~unsigned(_mm_movemask_epi8(_mm_packs_epi16(ascii0, ascii1))) & 0xFFFF;
+        if (non_ascii)
+        {
+            unsigned n = u8_ctz(non_ascii);
+            p += n;
+            o += n;
+            return;
+        }
+        p += 16;
+        o += 16;
+    }
+}
+
+// Shuffle tables that compress utf-8 bytes computed in fixed size lanes into a contiguous sequence.
+// one_two: 8 16 bit lanes with 1 or 2 bytes each, keyed by the mask of 1 byte lanes.
+// one_two_three: 4 32 bit lanes with 1 to 3 bytes each, keyed by m1 | m2 << 4, where m1 is the
+// mask of lanes with at least 2 bytes and m2 the mask of lanes with 3 bytes.
+struct utf16_to_utf8_tables
+{
+    unsigned char one_two[256][16];
+    unsigned char one_two_length[256];
+    unsigned char one_two_three[256][16];
+    unsigned char one_two_three_length[256];
+
+    utf16_to_utf8_tables()
+    {
+        for (unsigned key = 0; key < 256; ++key)
+        {
+            unsigned n = 0;
+            for (unsigned j = 0; j < 8; ++j)
+            {
+                one_two[key][n++] = (unsigned char)(2 * j);
+                if (!(key & (1u << j)))
+                    one_two[key][n++] = (unsigned char)(2 * j + 1);
+            }
+            one_two_length[key] = (unsigned char)n;
+            while (n < 16)
+                one_two[key][n++] = 0x80;
+
+            n = 0;
+            for (unsigned j = 0; j < 4; ++j)
+            {
+                unsigned length = 1 + ((key >> j) & 1) + ((key >> (j + 4)) & 1);
+                for (unsigned b = 0; b < length; ++b)
+                    one_two_three[key][n++] = (unsigned char)(4 * j + b);
+            }
+            one_two_three_length[key] = (unsigned char)n;
+            while (n < 16)
+                one_two_three[key][n++] = 0x80;
+        }
+    }
+};
+
+// loads 16 code units into 16 bit lanes. Returns false if a utf-32 code point does not fit.
+LIBPU8_TARGET("avx2")
+static inline bool narrow_load_avx2(const char16_t* p, __m256i& v)
+{
+    v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    return true;
+}
+
+LIBPU8_TARGET("avx2")
+static inline bool narrow_load_avx2(const char32_t* p, __m256i& v)
+{
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 8));
+    v = _mm256_permute4x64_epi64(_mm256_packus_epi32(a, b), 0xD8);
+    return _mm256_testz_si256(_mm256_or_si256(a, b), _mm256_set1_epi32(-0x10000)) != 0;
+}
+
+// Converts code points up to U+FFFF 16 code units at a time; leaves surrogates (and code points
+// above U+FFFF in utf-32) to the caller. Ascii blocks are packed, blocks below U+0800 are encoded
+// in 16 bit lanes and all other blocks in 32 bit lanes, followed by compressing the lanes with a
+// shuffle.
+template <class Char>
+LIBPU8_TARGET("avx2")
+static void narrow_avx2(const Char*& p, const Char* end, unsigned char*& o)
+{
+    static const utf16_to_utf8_tables tables;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i mask_3f = _mm256_set1_epi16(0x3F);
+    const __m256i limit_80 = _mm256_set1_epi16(0x80);
+    const __m256i surrogate_bits = _mm256_set1_epi16(-0x800);  // 0xF800
+    const __m256i surrogate_value = _mm256_set1_epi16(-0x2800); // 0xD800
+    const __m256i mask32_3f = _mm256_set1_epi32(0x3F);
+    // at least 32 code units, so that 16 byte stores stay within 3 * (end - p) bytes
+    while (end - p >= 32)
+    {
+        __m256i v;
+        if (!narrow_load_avx2(p, v))
+            return;
+        // unsigned v < 0x80 and v < 0x800, by comparing v & ~mask to zero
+        __m256i ascii = _mm256_cmpeq_epi16(_mm256_and_si256(v, _mm256_set1_epi16(-0x80)), zero);
+        if (_mm256_movemask_epi8(ascii) == -1)
+        {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(o),
+                _mm_packus_epi16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+            p += 16;
+            o += 16;
+            continue;
+        }
+        __m256i below_800 = _mm256_cmpeq_epi16(_mm256_and_si256(v, surrogate_bits), zero);
+        if (_mm256_movemask_epi8(below_800) == -1)
+        {
+            // lane = 110xxxxx 10xxxxxx in memory order, or the ascii byte
+            __m256i two = _mm256_or_si256(
+                _mm256_or_si256(_mm256_srli_epi16(v, 6), _mm256_set1_epi16(0xC0)),
+                _mm256_slli_epi16(_mm256_or_si256(_mm256_and_si256(v, mask_3f), limit_80), 8));
+            __m256i lanes = _mm256_blendv_epi8(two, v, ascii);
+            unsigned key = unsigned(_mm256_movemask_epi8(_mm256_packs_epi16(ascii, zero)));
+            unsigned key0 = key & 0xFF, key1 = (key >> 16) & 0xFF;
+            __m128i out0 = _mm_shuffle_epi8(_mm256_castsi256_si128(lanes),
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(tables.one_two[key0])));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(o), out0);
+            o += tables.one_two_length[key0];
+            __m128i out1 = _mm_shuffle_epi8(_mm256_extracti128_si256(lanes, 1),
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(tables.one_two[key1])));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(o), out1);
+            o += tables.one_two_length[key1];
+            p += 16;
+            continue;
+        }
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_and_si256(v, surrogate_bits), surrogate_value)))
+            return;
+        for (unsigned half = 0; half < 2; ++half)
+        {
+            __m256i u = _mm256_cvtepu16_epi32(half ? _mm256_extracti128_si256(v, 1) : _mm256_castsi256_si128(v));
+            __m256i ge80 = _mm256_cmpgt_epi32(u, _mm256_set1_epi32(0x7F));
+            __m256i ge800 = _mm256_cmpgt_epi32(u, _mm256_set1_epi32(0x7FF));
+            __m256i last = _mm256_or_si256(_mm256_and_si256(u, mask32_3f), _mm256_set1_epi32(0x80));
+            // 110xxxxx 10xxxxxx
+            __m256i two = _mm256_or_si256(_mm256_or_si256(_mm256_srli_epi32(u, 6), _mm256_set1_epi32(0xC0)),
+                _mm256_slli_epi32(last, 8));
+            // 1110xxxx 10xxxxxx 10xxxxxx
+            __m256i middle = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(u, 6), mask32_3f), _mm256_set1_epi32(0x80));
+            __m256i three = _mm256_or_si256(_mm256_or_si256(_mm256_srli_epi32(u, 12), _mm256_set1_epi32(0xE0)),
+                _mm256_or_si256(_mm256_slli_epi32(middle, 8), _mm256_slli_epi32(last, 16)));
+            __m256i lanes = _mm256_blendv_epi8(_mm256_blendv_epi8(u, two, ge80), three, ge800);
+            unsigned m1 = unsigned(_mm256_movemask_ps(_mm256_castsi256_ps(ge80)));
+            unsigned m2 = unsigned(_mm256_movemask_ps(_mm256_castsi256_ps(ge800)));
+            unsigned key0 = (m1 & 0xF) | ((m2 & 0xF) << 4), key1 = (m1 >> 4) | (m2 & 0xF0);
+            __m128i out0 = _mm_shuffle_epi8(_mm256_castsi256_si128(lanes),
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(tables.one_two_three[key0])));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(o), out0);
+            o += tables.one_two_three_length[key0];
+            __m128i out1 = _mm_shuffle_epi8(_mm256_extracti128_si256(lanes, 1),
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(tables.one_two_three[key1])));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(o), out1);
+            o += tables.one_two_three_length[key1];
+        }
+        p += 16;
+    }
+}
+
+#endif // LIBPU8_X86
+
+#if LIBPU8_AVX512
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+// Converts code points up to U+FFFF; leaves surrogates to the caller. Each code unit is encoded
+// into a 32 bit lane and the bytes in use are compressed into contiguous utf-8 with vpcompressb.
+LIBPU8_TARGET("avx512f,avx512bw,avx512vl,avx512vbmi2,popcnt")
+static void narrow_avx512(const char16_t*& p, const char16_t* end, unsigned char*& o)
+{
+    const __m512i mask_3f = _mm512_set1_epi32(0x3F);
+    const __m512i cont_bits = _mm512_set1_epi32(0x80);
+    while (end - p >= 32)
+    {
+        __m512i v = _mm512_loadu_si512(p);
+        if (!_mm512_test_epi16_mask(v, _mm512_set1_epi16(-0x80)))
+        {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(o), _mm512_cvtepi16_epi8(v));
+            p += 32;
+            o += 32;
+            continue;
+        }
+        if (_mm512_cmpeq_epi16_mask(_mm512_and_si512(v, _mm512_set1_epi16(-0x800)), _mm512_set1_epi16(-0x2800)))
+            return;
+        for (unsigned half = 0; half < 2; ++half)
+        {
+            __m512i u = _mm512_cvtepu16_epi32(half ? _mm512_extracti64x4_epi64(v, 1) : _mm512_castsi512_si256(v));
+            __mmask16 ge80 = _mm512_cmpgt_epu32_mask(u, _mm512_set1_epi32(0x7F));
+            __mmask16 ge800 = _mm512_cmpgt_epu32_mask(u, _mm512_set1_epi32(0x7FF));
+            __m512i last = _mm512_or_si512(_mm512_and_si512(u, mask_3f), cont_bits);
+            // 110xxxxx 10xxxxxx
+            __m512i two = _mm512_or_si512(_mm512_or_si512(_mm512_srli_epi32(u, 6), _mm512_set1_epi32(0xC0)),
+                _mm512_slli_epi32(last, 8));
+            // 1110xxxx 10xxxxxx 10xxxxxx
+            __m512i middle = _mm512_or_si512(_mm512_and_si512(_mm512_srli_epi32(u, 6), mask_3f), cont_bits);
+            __m512i three = _mm512_or_si512(_mm512_or_si512(_mm512_srli_epi32(u, 12), _mm512_set1_epi32(0xE0)),
+                _mm512_or_si512(_mm512_slli_epi32(middle, 8), _mm512_slli_epi32(last, 16)));
+            __m512i lanes = _mm512_mask_blend_epi32(ge800, _mm512_mask_blend_epi32(ge80, u, two), three);
+            // the high bit of each byte in use
+            __m512i used = _mm512_mask_mov_epi32(_mm512_mask_mov_epi32(_mm512_set1_epi32(0x80), ge80,
+                _mm512_set1_epi32(0x8080)), ge800, _mm512_set1_epi32(0x808080));
+            uint64_t bytes = _mm512_movepi8_mask(used);
+            unsigned n = u8_popcount64(bytes);
+            _mm512_mask_storeu_epi8(o, (uint64_t(1) << n) - 1, _mm512_maskz_compress_epi8(bytes, lanes));
+            o += n;
+        }
+        p += 32;
+    }
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#endif // LIBPU8_AVX512
+
+template <class Char>
+static narrow_kernel<Char> select_narrow_kernel();
+
+template <>
+narrow_kernel<char16_t> select_narrow_kernel<char16_t>()
+{
+#if LIBPU8_X86
+    unsigned features = u8_cpu_features();
+#if LIBPU8_AVX512
+    if (features & U8CPU_AVX512)
+        return narrow_avx512;
+#endif
+    if (features & U8CPU_AVX2)
+        return narrow_avx2<char16_t>;
+    if (features & U8CPU_SSE2)
+        return narrow_ascii_sse2<char16_t>;
+#endif
+    return narrow_ascii_scalar<char16_t>;
+}
+
+template <>
+narrow_kernel<char32_t> select_narrow_kernel<char32_t>()
+{
+#if LIBPU8_X86
+    unsigned features = u8_cpu_features();
+    if (features & U8CPU_AVX2)
+        return narrow_avx2<char32_t>;
+    if (features & U8CPU_SSE2)
+        return narrow_ascii_sse2<char32_t>;
+#endif
+    return narrow_ascii_scalar<char32_t>;
+}
+
+// Converts len code units of utf-16 or utf-32 (Char) to utf-8 into out, which has room for
+// out_capacity bytes. Unpaired surrogates are invalid, and in utf-32 all surrogates and values
+// above U+10FFFF. Error handling is the same as for convert_from_utf8. Bounded is false if
+// out_capacity >= 3 * len for utf-16 and 4 * len for utf-32.
+template <class Char, bool Bounded>
+static u8_conversion_result convert_to_utf8(const Char* s, size_t len, char* out, size_t out_capacity,
+    bool replace_inv_chars)
+{
+    static const narrow_kernel<Char> narrow = select_narrow_kernel<Char>();
+    const Char* p = s;
+    const Char* end = s + len;
+    unsigned char* const begin = reinterpret_cast<unsigned char*>(out);
+    unsigned char* o = begin;
+    unsigned char* o_end = begin + out_capacity;
+    while (p < end)
+    {
+        // the kernel writes at most 3 bytes per code unit it reads
+        size_t room = size_t(o_end - o) / 3;
+        narrow(p, !Bounded || size_t(end - p) <= room ? end : p + room, o);
+        // continue with whatever the kernel left, for at least 16 code units
+        const Char* scalar_end = end - p > 16 ? p + 16 : end;
+        while (p < scalar_end)
+        {
+            uint32_t u = *p++;
+            if (u < 0x80)
+            {
+                if (Bounded && o == o_end)
+                    goto output_full;
+                *o++ = (unsigned char)u;
+                continue;
+            }
+            if (u < 0x800)
+            {
+                if (Bounded && o_end - o < 2)
+                    goto output_full;
+                *o++ = (unsigned char)(0xC0 | (u >> 6));
+                *o++ = (unsigned char)(0x80 | (u & 0x3F));
+                continue;
+            }
+            // surrogates, and in utf-32 everything above U+FFFF
+            if (u >= 0xD800 && (u < 0xE000 || u > 0xFFFF))
+            {
+                if (sizeof(Char) == 2 ? u < 0xDC00 && p < end && (*p & 0xFC00) == 0xDC00 : u > 0xFFFF && u < 0x110000)
+                {
+                    if (Bounded && o_end - o < 4)
+                        goto output_full;
+                    uint32_t cp = sizeof(Char) == 2 ? 0x10000 + ((u - 0xD800) << 10) + (*p++ - 0xDC00) : u;
+                    *o++ = (unsigned char)(0xF0 | (cp >> 18));
+                    *o++ = (unsigned char)(0x80 | ((cp >> 12) & 0x3F));
+                    *o++ = (unsigned char)(0x80 | ((cp >> 6) & 0x3F));
+                    *o++ = (unsigned char)(0x80 | (cp & 0x3F));
+                    continue;
+                }
+                if (!replace_inv_chars)
+                    return u8_make_result(u8_conversion_status::invalid_input, size_t(p - s), size_t(o - begin),
+                        size_t(p - 1 - s));
+                u = u8_replacement_char;
+            }
+            if (Bounded && o_end - o < 3)
+                goto output_full;
+            *o++ = (unsigned char)(0xE0 | (u >> 12));
+            *o++ = (unsigned char)(0x80 | ((u >> 6) & 0x3F));
+            *o++ = (unsigned char)(0x80 | (u & 0x3F));
+        }
+    }
+    return u8_make_result(u8_conversion_status::ok, len, size_t(o - begin), len);
+output_full:
+    // p is one behind the code unit that did not fit
+    --p;
+    return u8_make_result(u8_conversion_status::output_too_small, size_t(p - s), size_t(o - begin), size_t(p - s));
+}
+
+// convert_to_utf8, counted if LIBPU8_INSTRUMENT is 1
+template <bool Bounded>
+static u8_conversion_result utf16_to_utf8(const char16_t* s, size_t len, char* out, size_t out_capacity,
+    bool replace_inv_chars)
+{
+#if LIBPU8_INSTRUMENT
+    u8_call_timer timer;
+    u8_conversion_result result = convert_to_utf8<char16_t, Bounded>(s, len, out, out_capacity, replace_inv_chars);
+    timer.record(u8_counter_to8, result.input_consumed, result.output_written,
+        result.status == u8_conversion_status::invalid_input);
+    return result;
+#else
+    return convert_to_utf8<char16_t, Bounded>(s, len, out, out_capacity, replace_inv_chars);
+#endif
+}
+
+template <bool Bounded>
+static u8_conversion_result utf32_to_utf8(const char32_t* s, size_t len, char* out, size_t out_capacity,
+    bool replace_inv_chars)
+{
+#if LIBPU8_INSTRUMENT
+    u8_call_timer timer;
+    u8_conversion_result result = convert_to_utf8<char32_t, Bounded>(s, len, out, out_capacity, replace_inv_chars);
+    timer.record(u8_counter_from32, result.input_consumed, result.output_written,
+        result.status == u8_conversion_status::invalid_input);
+    return result;
+#else
+    return convert_to_utf8<char32_t, Bounded>(s, len, out, out_capacity, replace_inv_chars);
+#endif
+}
+
+// Kernels that convert a prefix of the utf-16 in [p, end) to utf-32 and advance p and o past it.
+// They stop in front of surrogates. o must have room for end - p code points.
+typedef void (*utf16_to_utf32_kernel)(const char16_t*& p, const char16_t* end, char32_t*& o);
+// Kernels that convert a prefix of the utf-32 in [p, end) to utf-16 and advance p and o past it.
+// They stop in front of code points above U+FFFF, surrogates and invalid values. o must have room
+// for end - p code units.
+typedef void (*utf32_to_utf16_kernel)(const char32_t*& p, const char32_t* end, char16_t*& o);
+
+static void utf16_to_utf32_scalar(const char16_t*& p, const char16_t* end, char32_t*& o)
+{
+    while (p < end && (*p & 0xF800) != 0xD800)
+        *o++ = *p++;
+}
+
+static void utf32_to_utf16_scalar(const char32_t*& p, const char32_t* end, char16_t*& o)
+{
+    while (p < end && *p < 0x10000 && (*p & 0xF800) != 0xD800)
+        *o++ = char16_t(*p++);
+}
+
+#if LIBPU8_X86
+
+LIBPU8_TARGET("sse2")
+static void utf16_to_utf32_sse2(const char16_t*& p, const char16_t* end, char32_t*& o)
+{
+    const __m128i zero = _mm_setzero_si128();
+    while (end - p >= 8)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(o), _mm_unpacklo_epi16(v, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(o + 4), _mm_unpackhi_epi16(v, zero));
+        unsigned surrogates = unsigned(_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, _mm_set1_epi16(-0x800)),
+            _mm_set1_epi16(-0x2800))));
+        if (surrogates)
+        {
+            unsigned n = u8_ctz(surrogates) / 2;
+            p += n;
+            o += n;
+            return;
+        }
+        p += 8;
+        o += 8;
+    }
+}
+
+// the 32 bit lanes of v that are not a code point up to U+FFFF other than a surrogate
+LIBPU8_TARGET("sse2")
+static inline __m128i utf32_not_bmp_sse2(__m128i v)
+{
+    __m128i above = _mm_xor_si128(_mm_cmpeq_epi32(_mm_srli_epi32(v, 16), _mm_setzero_si128()), _mm_set1_epi32(-1));
+    return _mm_or_si128(above, _mm_cmpeq_epi32(_mm_and_si128(v, _mm_set1_epi32(-0x800)), _mm_set1_epi32(0xD800)));
+}
+
+LIBPU8_TARGET("sse2")
+static void utf32_to_utf16_sse2(const char32_t*& p, const char32_t* end, char16_t*& o)
+{
+    // packs_epi32 saturates signed values, so 0x8000 is subtracted before and added back after
+    const __m128i bias32 = _mm_set1_epi32(0x8000);
+    const __m128i bias16 = _mm_set1_epi16(-0x8000);
+    while (end - p >= 8)
+    {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 4));
+        __m128i packed = _mm_packs_epi32(_mm_sub_epi32(a, bias32), _mm_sub_epi32(b, bias32));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(o), _mm_xor_si128(packed, bias16));
+        unsigned stop = unsigned(_mm_movemask_ps(_mm_castsi128_ps(utf32_not_bmp_sse2(a))))
+            | unsigned(_mm_movemask_ps(_mm_castsi128_ps(utf32_not_bmp_sse2(b)))) << 4;
+        if (stop)
+        {
+            unsigned n = u8_ctz(stop);
+            p += n;
+            o += n;
+            return;
+        }
+        p += 8;
+        o += 8;
+    }
+}
+
+LIBPU8_TARGET("avx2")
+static void utf16_to_utf32_avx2(const char16_t*& p, const char16_t* end, char32_t*& o)
+{
+    while (end - p >= 16)
+    {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(o), _mm256_cvtepu16_epi32(_mm256_castsi256_si128(v)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(o + 8), _mm256_cvtepu16_epi32(_mm256_extracti128_si256(v, 1)));
+        uint32_t surrogates = uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi16(
+            _mm256_and_si256(v, _mm256_set1_epi16(-0x800)), _mm256_set1_epi16(-0x2800))));
+        if (surrogates)
+        {
+            unsigned n = u8_ctz(surrogates) / 2;
+            p += n;
+            o += n;
+            return;
+        }
+        p += 16;
+        o += 16;
+    }
+}
+
+LIBPU8_TARGET("avx2")
+static inline __m256i utf32_not_bmp_avx2(__m256i v)
+{
+    __m256i above = _mm256_xor_si256(_mm256_cmpeq_epi32(_mm256_srli_epi32(v, 16), _mm256_setzero_si256()),
+        _mm256_set1_epi32(-1));
+    return _mm256_or_si256(above, _mm256_cmpeq_epi32(_mm256_and_si256(v, _mm256_set1_epi32(-0x800)),
+        _mm256_set1_epi32(0xD800)));
+}
+
+LIBPU8_TARGET("avx2")
+static void utf32_to_utf16_avx2(const char32_t*& p, const char32_t* end, char16_t*& o)
+{
+    while (end - p >= 16)
+    {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 8));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(o), _mm256_permute4x64_epi64(_mm256_packus_epi32(a, b), 0xD8));
+        uint32_t stop = uint32_t(_mm256_movemask_ps(_mm256_castsi256_ps(utf32_not_bmp_avx2(a))))
+            | uint32_t(_mm256_movemask_ps(_mm256_castsi256_ps(utf32_not_bmp_avx2(b)))) << 8;
+        if (stop)
+        {
+            unsigned n = u8_ctz(stop);
+            p += n;
+            o += n;
+            return;
+        }
+        p += 16;
+        o += 16;
+    }
+}
+
+#endif // LIBPU8_X86
+
+static utf16_to_utf32_kernel select_utf16_to_utf32_kernel()
+{
+#if LIBPU8_X86
+    unsigned features = u8_cpu_features();
+    if (features & U8CPU_AVX2)
+        return utf16_to_utf32_avx2;
+    if (features & U8CPU_SSE2)
+        return utf16_to_utf32_sse2;
+#endif
+    return utf16_to_utf32_scalar;
+}
+
+static utf32_to_utf16_kernel select_utf32_to_utf16_kernel()
+{
+#if LIBPU8_X86
+    unsigned features = u8_cpu_features();
+    if (features & U8CPU_AVX2)
+        return utf32_to_utf16_avx2;
+    if (features & U8CPU_SSE2)
+        return utf32_to_utf16_sse2;
+#endif
+    return utf32_to_utf16_scalar;
+}
+
+// Converts len code units of utf-16 to utf-32 into out, which has room for out_capacity code
+// points. Error handling is the same as for convert_from_utf8. Bounded is false if
+// out_capacity >= len.
+template <bool Bounded>
+static u8_conversion_result convert_utf16_to_utf32(const char16_t* s, size_t len, char32_t* out, size_t out_capacity,
+    bool replace_inv_chars)
+{
+    static const utf16_to_utf32_kernel expand = select_utf16_to_utf32_kernel();
+    const char16_t* p = s;
+    const char16_t* end = s + len;
+    char32_t* o = out;
+    char32_t* o_end = out + out_capacity;
+    while (p < end)
+    {
+        size_t room = size_t(o_end - o);
+        expand(p, !Bounded || size_t(end - p) <= room ? end : p + room, o);
+        // continue with whatever the kernel left, for at least 16 code units
+        const char16_t* scalar_end = end - p > 16 ? p + 16 : end;
+        while (p < scalar_end)
+        {
+            if (Bounded && o == o_end)
+                goto output_full;
+            uint32_t u = *p++;
+            if ((u & 0xF800) == 0xD800)
+            {
+                if (u < 0xDC00 && p < end && (*p & 0xFC00) == 0xDC00)
+                    u = 0x10000 + ((u - 0xD800) << 10) + (*p++ - 0xDC00);
+                else if (!replace_inv_chars)
+                    return u8_make_result(u8_conversion_status::invalid_input, size_t(p - s), size_t(o - out),
+                        size_t(p - 1 - s));
+                else
+                    u = u8_replacement_char;
+            }
+            *o++ = char32_t(u);
+        }
+    }
+    return u8_make_result(u8_conversion_status::ok, len, size_t(o - out), len);
+output_full:
+    return u8_make_result(u8_conversion_status::output_too_small, size_t(p - s), size_t(o - out), size_t(p - s));
+}
+
+// Converts len code points of utf-32 to utf-16 into out, which has room for out_capacity code
+// units. Surrogates and values above U+10FFFF are invalid. Bounded is false if
+// out_capacity >= 2 * len.
+template <bool Bounded>
+static u8_conversion_result convert_utf32_to_utf16(const char32_t* s, size_t len, char16_t* out, size_t out_capacity,
+    bool replace_inv_chars)
+{
+    static const utf32_to_utf16_kernel compress = select_utf32_to_utf16_kernel();
+    const char32_t* p = s;
+    const char32_t* end = s + len;
+    char16_t* o = out;
+    char16_t* o_end = out + out_capacity;
+    while (p < end)
+    {
+        size_t room = size_t(o_end - o);
+        compress(p, !Bounded || size_t(end - p) <= room ? end : p + room, o);
+        const char32_t* scalar_end = end - p > 16 ? p + 16 : end;
+        while (p < scalar_end)
+        {
+            uint32_t u = *p++;
+            if (u >= 0xD800 && (u < 0xE000 || u > 0xFFFF))
+            {
+                if (u > 0xFFFF && u < 0x110000)
+                {
+                    if (Bounded && o_end - o < 2)
+                        goto output_full;
+                    u -= 0x10000;
+                    *o++ = char16_t(0xD800 + (u >> 10));
+                    *o++ = char16_t(0xDC00 + (u & 0x3FF));
+                    continue;
+                }
+                if (!replace_inv_chars)
+                    return u8_make_result(u8_conversion_status::invalid_input, size_t(p - s), size_t(o - out),
+                        size_t(p - 1 - s));
+                u = u8_replacement_char;
+            }
+            if (Bounded && o == o_end)
+                goto output_full;
+            *o++ = char16_t(u);
+        }
+    }
+    return u8_make_result(u8_conversion_status::ok, len, size_t(o - out), len);
+output_full:
+    // p is one behind the code point that did not fit
+    --p;
+    return u8_make_result(u8_conversion_status::output_too_small, size_t(p - s), size_t(o - out), size_t(p - s));
+}
+
+// convert_utf16_to_utf32 and convert_utf32_to_utf16, counted if LIBPU8_INSTRUMENT is 1
+template <bool Bounded>
+static u8_conversion_result utf16_to_utf32(const char16_t* s, size_t len, char32_t* out, size_t out_capacity,
+    bool replace_inv_chars)
+{
+#if LIBPU8_INSTRUMENT
+    u8_call_timer timer;
+    u8_conversion_result result = convert_utf16_to_utf32<Bounded>(s, len, out, out_capacity, replace_inv_chars);
+    timer.record(u8_counter_to32, result.input_consumed, result.output_written,
+        result.status == u8_conversion_status::invalid_input);
+    return result;
+#else
+    return convert_utf16_to_utf32<Bounded>(s, len, out, out_capacity, replace_inv_chars);
+#endif
+}
+
+template <bool Bounded>
+static u8_conversion_result utf32_to_utf16(const char32_t* s, size_t len, char16_t* out, size_t out_capacity,
+    bool replace_inv_chars)
+{
+#if LIBPU8_INSTRUMENT
+    u8_call_timer timer;
+    u8_conversion_result result = convert_utf32_to_utf16<Bounded>(s, len, out, out_capacity, replace_inv_chars);
+    timer.record(u8_counter_from32, result.input_consumed, result.output_written,
+        result.status == u8_conversion_status::invalid_input);
+    return result;
+#else
+    return convert_utf32_to_utf16<Bounded>(s, len, out, out_capacity, replace_inv_chars);
+#endif
+}
+
+// Returns the number of bytes at the end of [begin, end) that are a proper prefix of a well-formed
+// sequence, so that more input may complete them. This is at most 3.
+static size_t utf8_incomplete_tail(const unsigned char* begin, const unsigned char* end)
+{
+    for (size_t n = 1; n <= 3 && n <= size_t(end - begin); ++n)
+    {
+        const unsigned char* lead = end - n;
+        if ((*lead & 0xC0) == 0x80)
+            continue;
+        unsigned state = utf8_transition[utf8_class[*lead]];
+        for (const unsigned char* q = lead + 1; q < end && state > U8S_REJECT; ++q)
+            state = utf8_transition[state * 16 + utf8_class[*q]];
+        return state > U8S_REJECT ? n : 0;
+    }
+    return 0;
+}
+
+// Kernels that validate a prefix of the utf-8 in [p, end). They return a position b such that all
+// code points that end before b are valid, and stop early at the first block with an error.
+// The code point that straddles b, if any, is left to the caller.
+typedef const unsigned char* (*validate_kernel)(const unsigned char* p, const unsigned char* end);
+
+static const unsigned char* validate_none(const unsigned char* p, const unsigned char*)
+{
+    return p;
+}
+
+#if LIBPU8_X86
+
+LIBPU8_TARGET("sse2")
+static const unsigned char* validate_ascii_sse2(const unsigned char* p, const unsigned char* end)
+{
+    while (end - p >= 16 && !_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))))
+        p += 16;
+    return p;
+}
+
+// The lookup algorithm of Keiser and Lemire, "Validating UTF-8 In Less Than One Instruction
+// Per Byte" (2021). Each byte is classified by its high nibble and by the high and low nibble
+// of the previous byte. The three table lookups are and-ed, which leaves a bit set for each
+// error pattern that applies, except for the 3rd and 4th bytes of 3 and 4 byte sequences.
+// These are continuation bytes that follow a continuation byte, and must be where the
+// leading byte two or three positions earlier announced them.
+enum
+{
+    U8V_TOO_SHORT = 1 << 0,     // 11______ 0_______ or 11______ 11______
+    U8V_TOO_LONG = 1 << 1,      // 0_______ 10______
+    U8V_OVERLONG_3 = 1 << 2,    // 11100000 100_____
+    U8V_TOO_LARGE = 1 << 3,     // 11110100 1001____, 11110100 101_____, 11110101.. 1001____ ...
+    U8V_SURROGATE = 1 << 4,     // 11101101 101_____
+    U8V_OVERLONG_2 = 1 << 5,    // 1100000_ 10______
+    U8V_TOO_LARGE_1000 = 1 << 6, // 11110101.. 1000____
+    U8V_OVERLONG_4 = 1 << 6,    // 11110000 1000____
+    U8V_TWO_CONTS = 1 << 7,     // 10______ 10______
+    U8V_CARRY = U8V_TOO_SHORT | U8V_TOO_LONG | U8V_TWO_CONTS
+};
+
+static const unsigned char utf8_byte_1_high[16] =
+{
+    // 0_______ (ascii)
+    U8V_TOO_LONG, U8V_TOO_LONG, U8V_TOO_LONG, U8V_TOO_LONG,
+    U8V_TOO_LONG, U8V_TOO_LONG, U8V_TOO_LONG, U8V_TOO_LONG,
+    // 10______ (continuation)
+    U8V_TWO_CONTS, U8V_TWO_CONTS, U8V_TWO_CONTS, U8V_TWO_CONTS,
+    // 1100____
+    U8V_TOO_SHORT | U8V_OVERLONG_2,
+    // 1101____
+    U8V_TOO_SHORT,
+    // 1110____
+    U8V_TOO_SHORT | U8V_OVERLONG_3 | U8V_SURROGATE,
+    // 1111____
+    U8V_TOO_SHORT | U8V_TOO_LARGE | U8V_TOO_LARGE_1000 | U8V_OVERLONG_4
+};
+
+static const unsigned char utf8_byte_1_low[16] =
+{
+    // ____0000
+    U8V_CARRY | U8V_OVERLONG_3 | U8V_OVERLONG_2 | U8V_OVERLONG_4,
+    // ____0001
+    U8V_CARRY | U8V_OVERLONG_2,
+    // ____001_
+    U8V_CARRY,
+    U8V_CARRY,
+    // ____0100
+    U8V_CARRY | U8V_TOO_LARGE,
+    // ____0101 .. ____1100
+    U8V_CARRY | U8V_TOO_LARGE | U8V_TOO_LARGE_1000,
+    U8V_CARRY | U8V_TOO_LARGE | U8V_TOO_LARGE_1000,
+    U8V_CARRY | U8V_TOO_LARGE | U8V_TOO_LARGE_1000,
+    U8V_CARRY | U8V_TOO_LARGE | U8V_TOO_LARGE_1000,
+    U8V_CARRY | U8V_TOO_LARGE | U8V_TOO_LARGE_1000,
+    U8V_CARRY | U8V_TOO_LARGE | U8V_TOO_LARGE_1000,
+    U8V_CARRY | U8V_TOO_LARGE | U8V_TOO_LARGE_1000,
+    U8V_CARRY | U8V_TOO_LARGE | U8V_TOO_LARGE_1000,
+    // ____1101
+    U8V_CARRY | U8V_TOO_LARGE | U8V_TOO_LARGE_1000 | U8V_SURROGATE,
+    // ____111_
+    U8V_CARRY | U8V_TOO_LARGE | U8V_TOO_LARGE_1000,
+    U8V_CARRY | U8V_TOO_LARGE | U8V_TOO_LARGE_1000
+};
+
+static const unsigned char utf8_byte_2_high[16] =
+{
+    // 0_______ (ascii)
+    U8V_TOO_SHORT, U8V_TOO_SHORT, U8V_TOO_SHORT, U8V_TOO_SHORT,
+    U8V_TOO_SHORT, U8V_TOO_SHORT, U8V_TOO_SHORT, U8V_TOO_SHORT,
+    // 1000____
+    U8V_TOO_LONG | U8V_OVERLONG_2 | U8V_TWO_CONTS | U8V_OVERLONG_3 | U8V_TOO_LARGE_1000 | U8V_OVERLONG_4,
+    // 1001____
+    U8V_TOO_LONG | U8V_OVERLONG_2 | U8V_TWO_CONTS | U8V_OVERLONG_3 | U8V_TOO_LARGE,
+    // 101_____
+    U8V_TOO_LONG | U8V_OVERLONG_2 | U8V_TWO_CONTS | U8V_SURROGATE | U8V_TOO_LARGE,
+    U8V_TOO_LONG | U8V_OVERLONG_2 | U8V_TWO_CONTS | U8V_SURROGATE | U8V_TOO_LARGE,
+    // 11______
+    U8V_TOO_SHORT, U8V_TOO_SHORT, U8V_TOO_SHORT, U8V_TOO_SHORT
+};
+
+// validate_avx2 with 16 byte vectors, for cpus without AVX2. pshufb and palignr are SSSE3.
+LIBPU8_TARGET("ssse3")
+static const unsigned char* validate_ssse3(const unsigned char* p, const unsigned char* end)
+{
+    const __m128i byte_1_high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(utf8_byte_1_high));
+    const __m128i byte_1_low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(utf8_byte_1_low));
+    const __m128i byte_2_high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(utf8_byte_2_high));
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    const __m128i third_byte_limit = _mm_set1_epi8(char(0xE0 - 0x80));
+    const __m128i fourth_byte_limit = _mm_set1_epi8(char(0xF0 - 0x80));
+    const __m128i high_bit = _mm_set1_epi8(char(0x80));
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i incomplete_limit = _mm_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, char(0xF0 - 1), char(0xE0 - 1), char(0xC0 - 1));
+    __m128i prev_input = zero;
+    __m128i prev_incomplete = zero;
+    while (end - p >= 16)
+    {
+        __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        __m128i error;
+        if (!_mm_movemask_epi8(input))
+            error = prev_incomplete;
+        else
+        {
+            __m128i prev1 = _mm_alignr_epi8(input, prev_input, 16 - 1);
+            __m128i prev2 = _mm_alignr_epi8(input, prev_input, 16 - 2);
+            __m128i prev3 = _mm_alignr_epi8(input, prev_input, 16 - 3);
+            __m128i special_cases = _mm_and_si128(
+                _mm_and_si128(
+                    _mm_shuffle_epi8(byte_1_high, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+                    _mm_shuffle_epi8(byte_1_low, _mm_and_si128(prev1, nibble))),
+                _mm_shuffle_epi8(byte_2_high, _mm_and_si128(_mm_srli_epi16(input, 4), nibble)));
+            __m128i must_be_continuation = _mm_and_si128(_mm_or_si128(
+                _mm_subs_epu8(prev2, third_byte_limit), _mm_subs_epu8(prev3, fourth_byte_limit)), high_bit);
+            error = _mm_xor_si128(must_be_continuation, special_cases);
+            prev_incomplete = _mm_subs_epu8(input, incomplete_limit);
+            prev_input = input;
+        }
+        // without SSE4.1 ptest
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(error, zero)) != 0xFFFF)
+            break;
+        if (!_mm_movemask_epi8(input))
+        {
+            prev_incomplete = zero;
+            prev_input = input;
+        }
+        p += 16;
+    }
+    return p;
+}
+
+LIBPU8_TARGET("avx2")
+static inline __m256i u8_broadcast_table(const unsigned char* table)
+{
+    return _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(table)));
+}
+
+LIBPU8_TARGET("avx2")
+static const unsigned char* validate_avx2(const unsigned char* p, const unsigned char* end)
+{
+    const __m256i byte_1_high = u8_broadcast_table(utf8_byte_1_high);
+    const __m256i byte_1_low = u8_broadcast_table(utf8_byte_1_low);
+    const __m256i byte_2_high = u8_broadcast_table(utf8_byte_2_high);
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    const __m256i third_byte_limit = _mm256_set1_epi8(char(0xE0 - 0x80));
+    const __m256i fourth_byte_limit = _mm256_set1_epi8(char(0xF0 - 0x80));
+    const __m256i high_bit = _mm256_set1_epi8(char(0x80));
+    // bytes that leave a sequence incomplete if they are among the last 3 of a block
+    const __m256i incomplete_limit = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, char(0xF0 - 1), char(0xE0 - 1), char(0xC0 - 1));
+    __m256i prev_input = _mm256_setzero_si256();
+    __m256i prev_incomplete = _mm256_setzero_si256();
+    while (end - p >= 32)
+    {
+        __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        __m256i error;
+        if (!_mm256_movemask_epi8(input))
+            error = prev_incomplete;
+        else
+        {
+            // the input shifted by 1, 2 and 3 bytes, continuing with the previous block
+            __m256i carried = _mm256_permute2x128_si256(prev_input, input, 0x21);
+            __m256i prev1 = _mm256_alignr_epi8(input, carried, 16 - 1);
+            __m256i prev2 = _mm256_alignr_epi8(input, carried, 16 - 2);
+            __m256i prev3 = _mm256_alignr_epi8(input, carried, 16 - 3);
+            __m256i special_cases = _mm256_and_si256(
+                _mm256_and_si256(
+                    _mm256_shuffle_epi8(byte_1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+                    _mm256_shuffle_epi8(byte_1_low, _mm256_and_si256(prev1, nibble))),
+                _mm256_shuffle_epi8(byte_2_high, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+            // only 111_____ and 1111____ leave the high bit set
+            __m256i must_be_continuation = _mm256_and_si256(_mm256_or_si256(
+                _mm256_subs_epu8(prev2, third_byte_limit), _mm256_subs_epu8(prev3, fourth_byte_limit)), high_bit);
+            error = _mm256_xor_si256(must_be_continuation, special_cases);
+            prev_incomplete = _mm256_subs_epu8(input, incomplete_limit);
+            prev_input = input;
+        }
+        if (!_mm256_testz_si256(error, error))
+            break;
+        if (!_mm256_movemask_epi8(input))
+        {
+            prev_incomplete = _mm256_setzero_si256();
+            prev_input = input;
+        }
+        p += 32;
+    }
+    return p;
+}
+
+#endif // LIBPU8_X86
+
+static validate_kernel select_validate_kernel()
+{
+#if LIBPU8_X86
+    unsigned features = u8_cpu_features();
+    if (features & U8CPU_AVX2)
+        return validate_avx2;
+    if (features & U8CPU_SSSE3)
+        return validate_ssse3;
+    if (features & U8CPU_SSE2)
+        return validate_ascii_sse2;
+#endif
+    return validate_none;
+}
+
+static bool validate_utf8(const char* s, size_t len, size_t* error_offset)
+{
+    static const validate_kernel validate = select_validate_kernel();
+    const unsigned char* begin = reinterpret_cast<const unsigned char*>(s);
+    const unsigned char* end = begin + len;
+    const unsigned char* p = validate(begin, end);
+    // continue with the code point that straddles p
+    for (size_t i = 1; i <= 3 && i <= size_t(p - begin); ++i)
+    {
+        if ((p[-ptrdiff_t(i)] & 0xC0) != 0x80)
+        {
+            p -= i;
+            break;
+        }
+    }
+    while (p < end)
+    {
+        if (*p < 0x80)
+        {
+            ++p;
+            continue;
+        }
+        const unsigned char* seq = p;
+        if (decode_utf8(p, end) == u8_invalid_cp)
+        {
+            if (error_offset)
+                *error_offset = size_t(seq - begin);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool u8validate(const char* s, size_t len, size_t* error_offset)
+{
+#if LIBPU8_INSTRUMENT
+    u8_call_timer timer;
+    bool valid = validate_utf8(s, len, error_offset);
+    timer.record(u8_counter_validate, len, 0, !valid);
+    return valid;
+#else
+    return validate_utf8(s, len, error_offset);
+#endif
+}
+
+void u8_count_event(u8_stats_event event)
+{
+#if LIBPU8_INSTRUMENT
+    u8_counters().add(u8_counter_exception + unsigned(event), 1);
+#else
+    (void)event;
+#endif
+}
+
+// the tiers of the kernels that the select_ functions choose
+static void u8_selected_tiers(u8_stats& stats)
+{
+    u8_kernel_tier tier = u8_kernel_tier::scalar;
+#if LIBPU8_X86
+    unsigned features = u8_cpu_features();
+    if (features & U8CPU_SSE2)
+        tier = u8_kernel_tier::sse2;
+    if (features & U8CPU_AVX2)
+        tier = u8_kernel_tier::avx2;
+#endif
+    // validation and utf-32 have no AVX-512 kernels, and only validation has an SSSE3 kernel
+    stats.validate_tier = tier;
+#if LIBPU8_X86
+    if (tier == u8_kernel_tier::sse2 && (features & U8CPU_SSSE3))
+        stats.validate_tier = u8_kernel_tier::ssse3;
+#endif
+    stats.to32_tier = tier;
+    stats.from32_tier = tier;
+#if LIBPU8_AVX512
+    if (features & U8CPU_AVX512)
+        tier = u8_kernel_tier::avx512;
+#endif
+    stats.to16_tier = tier;
+    stats.to8_tier = tier;
+}
+
+u8_stats u8_get_stats()
+{
+    u8_stats stats = u8_stats();
+#if LIBPU8_INSTRUMENT
+    unsigned long long sums[u8_counter_count];
+    {
+        u8_stats_registry& registry = u8_registry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        for (unsigned i = 0; i < u8_counter_count; ++i)
+        {
+            sums[i] = registry.finished[i] - registry.reset[i];
+            for (size_t t = 0; t < registry.threads.size(); ++t)
+                sums[i] += registry.threads[t]->values[i].load(std::memory_order_relaxed);
+        }
+    }
+    u8_call_stats* calls[] = { &stats.to16, &stats.to8, &stats.validate, &stats.to32, &stats.from32 };
+    for (unsigned k = 0; k < 5; ++k)
+    {
+        const unsigned long long* c = sums + 5 * k;
+        calls[k]->calls = c[0];
+        calls[k]->input = c[1];
+        calls[k]->output = c[2];
+        calls[k]->errors = c[3];
+        calls[k]->nanoseconds = c[4];
+    }
+    stats.exceptions = sums[u8_counter_exception];
+    stats.sink_writes = sums[u8_counter_sink_write];
+    stats.source_reads = sums[u8_counter_source_read];
+#endif
+    u8_selected_tiers(stats);
+    return stats;
+}
+
+void u8_reset_stats()
+{
+#if LIBPU8_INSTRUMENT
+    u8_stats_registry& registry = u8_registry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for (unsigned i = 0; i < u8_counter_count; ++i)
+    {
+        registry.reset[i] = registry.finished[i];
+        for (size_t t = 0; t < registry.threads.size(); ++t)
+            registry.reset[i] += registry.threads[t]->values[i].load(std::memory_order_relaxed);
+    }
+#endif
+}
+
+// Kernels that count the output length of a prefix of [p, end) and advance p past it. They
+// assume valid input and work on whole code units, so p may end up anywhere.
+typedef size_t (*utf16_length_kernel)(const unsigned char*& p, const unsigned char* end);
+typedef size_t (*utf8_length_kernel)(const char16_t*& p, const char16_t* end);
+
+// a utf-8 sequence gives one utf-16 code unit per leading byte, and a second one for 4 byte sequences
+static inline size_t utf16_length_of_byte(unsigned char c)
+{
+    return size_t((c & 0xC0) != 0x80) + size_t(c >= 0xF0);
+}
+
+// a utf-16 code unit gives 1, 2 or 3 bytes; a surrogate pair gives 4
+static inline size_t utf8_length_of_unit(char16_t u)
+{
+    return 1 + size_t(u >= 0x80) + size_t(u >= 0x800) - size_t((u & 0xF800) == 0xD800);
+}
+
+static size_t utf16_length_none(const unsigned char*&, const unsigned char*)
+{
+    return 0;
+}
+
+static size_t utf8_length_none(const char16_t*&, const char16_t*)
+{
+    return 0;
+}
+
+#if LIBPU8_X86
+
+// The counters are kept in byte (or 16 bit) lanes: a comparison yields -1 per matching lane,
+// which is subtracted. The lanes are summed up before they can overflow.
+
+LIBPU8_TARGET("sse2")
+static size_t utf16_length_sse2(const unsigned char*& p, const unsigned char* end)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i last_continuation = _mm_set1_epi8(char(0xBF));
+    const __m128i four_byte_lead = _mm_set1_epi8(char(0xF0));
+    size_t n = 0;
+    while (end - p >= 16)
+    {
+        // at most 2 per block and lane
+        size_t blocks = size_t(end - p) / 16 < 127 ? size_t(end - p) / 16 : 127;
+        const unsigned char* chunk_end = p + 16 * blocks;
+        __m128i counts = zero;
+        for (; p < chunk_end; p += 16)
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            counts = _mm_sub_epi8(counts, _mm_cmpgt_epi8(v, last_continuation));
+            counts = _mm_sub_epi8(counts, _mm_cmpeq_epi8(_mm_max_epu8(v, four_byte_lead), v));
+        }
+        __m128i sums = _mm_sad_epu8(counts, zero);
+        n += size_t(_mm_cvtsi128_si32(sums)) + size_t(_mm_cvtsi128_si32(_mm_srli_si128(sums, 8)));
+    }
+    return n;
+}
+
+LIBPU8_TARGET("avx2")
+static size_t utf16_length_avx2(const unsigned char*& p, const unsigned char* end)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i last_continuation = _mm256_set1_epi8(char(0xBF));
+    const __m256i four_byte_lead = _mm256_set1_epi8(char(0xF0));
+    size_t n = 0;
+    while (end - p >= 32)
+    {
+        size_t blocks = size_t(end - p) / 32 < 127 ? size_t(end - p) / 32 : 127;
+        const unsigned char* chunk_end = p + 32 * blocks;
+        __m256i counts = zero;
+        for (; p < chunk_end; p += 32)
+        {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+            counts = _mm256_sub_epi8(counts, _mm256_cmpgt_epi8(v, last_continuation));
+            counts = _mm256_sub_epi8(counts, _mm256_cmpeq_epi8(_mm256_max_epu8(v, four_byte_lead), v));
+        }
+        __m256i sums = _mm256_sad_epu8(counts, zero);
+        __m128i sums128 = _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+        n += size_t(_mm_cvtsi128_si32(sums128)) + size_t(_mm_cvtsi128_si32(_mm_srli_si128(sums128, 8)));
+    }
+    return n;
+}
+
+// The 16 bit lanes are compared as signed numbers after flipping the sign bit.
+LIBPU8_TARGET("sse2")
+static size_t utf8_length_sse2(const char16_t*& p, const char16_t* end)
+{
+    const __m128i sign = _mm_set1_epi16(-0x8000);
+    const __m128i limit_80 = _mm_set1_epi16(0x7F - 0x8000);
+    const __m128i limit_800 = _mm_set1_epi16(0x7FF - 0x8000);
+    const __m128i surrogate_mask = _mm_set1_epi16(-0x800);
+    const __m128i surrogate = _mm_set1_epi16(-0x2800);
+    size_t n = 0;
+    while (end - p >= 8)
+    {
+        // at most 2 per block and lane
+        size_t blocks = size_t(end - p) / 8 < 8192 ? size_t(end - p) / 8 : 8192;
+        const char16_t* chunk_end = p + 8 * blocks;
+        __m128i counts = _mm_setzero_si128();
+        for (; p < chunk_end; p += 8)
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            __m128i biased = _mm_xor_si128(v, sign);
+            counts = _mm_sub_epi16(counts, _mm_cmpgt_epi16(biased, limit_80));
+            counts = _mm_sub_epi16(counts, _mm_cmpgt_epi16(biased, limit_800));
+            counts = _mm_add_epi16(counts, _mm_cmpeq_epi16(_mm_and_si128(v, surrogate_mask), surrogate));
+        }
+        __m128i sums = _mm_madd_epi16(counts, _mm_set1_epi16(1));
+        sums = _mm_add_epi32(sums, _mm_srli_si128(sums, 8));
+        sums = _mm_add_epi32(sums, _mm_srli_si128(sums, 4));
+        n += 8 * blocks + size_t(_mm_cvtsi128_si32(sums));
+    }
+    return n;
+}
+
+LIBPU8_TARGET("avx2")
+static size_t utf8_length_avx2(const char16_t*& p, const char16_t* end)
+{
+    const __m256i sign = _mm256_set1_epi16(-0x8000);
+    const __m256i limit_80 = _mm256_set1_epi16(0x7F - 0x8000);
+    const __m256i limit_800 = _mm256_set1_epi16(0x7FF - 0x8000);
+    const __m256i surrogate_mask = _mm256_set1_epi16(-0x800);
+    const __m256i surrogate = _mm256_set1_epi16(-0x2800);
+    size_t n = 0;
+    while (end - p >= 16)
+    {
+        size_t blocks = size_t(end - p) / 16 < 8192 ? size_t(end - p) / 16 : 8192;
+        const char16_t* chunk_end = p + 16 * blocks;
+        __m256i counts = _mm256_setzero_si256();
+        for (; p < chunk_end; p += 16)
+        {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+            __m256i biased = _mm256_xor_si256(v, sign);
+            counts = _mm256_sub_epi16(counts, _mm256_cmpgt_epi16(biased, limit_80));
+            counts = _mm256_sub_epi16(counts, _mm256_cmpgt_epi16(biased, limit_800));
+            counts = _mm256_add_epi16(counts, _mm256_cmpeq_epi16(_mm256_and_si256(v, surrogate_mask), surrogate));
+        }
+        __m256i sums256 = _mm256_madd_epi16(counts, _mm256_set1_epi16(1));
+        __m128i sums = _mm_add_epi32(_mm256_castsi256_si128(sums256), _mm256_extracti128_si256(sums256, 1));
+        sums = _mm_add_epi32(sums, _mm_srli_si128(sums, 8));
+        sums = _mm_add_epi32(sums, _mm_srli_si128(sums, 4));
+        n += 16 * blocks + size_t(_mm_cvtsi128_si32(sums));
+    }
+    return n;
+}
+
+#endif // LIBPU8_X86
+
+static utf16_length_kernel select_utf16_length_kernel()
+{
+#if LIBPU8_X86
+    unsigned features = u8_cpu_features();
+    if (features & U8CPU_AVX2)
+        return utf16_length_avx2;
+    if (features & U8CPU_SSE2)
+        return utf16_length_sse2;
+#endif
+    return utf16_length_none;
+}
+
+static utf8_length_kernel select_utf8_length_kernel()
+{
+#if LIBPU8_X86
+    unsigned features = u8_cpu_features();
+    if (features & U8CPU_AVX2)
+        return utf8_length_avx2;
+    if (features & U8CPU_SSE2)
+        return utf8_length_sse2;
+#endif
+    return utf8_length_none;
+}
+
+size_t u8to16_length(const char* s, size_t len)
+{
+    static const utf16_length_kernel count = select_utf16_length_kernel();
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(s);
+    const unsigned char* end = p + len;
+    size_t n = count(p, end);
+    for (; p < end; ++p)
+        n += utf16_length_of_byte(*p);
+    return n;
+}
+
+size_t u16to8_length(const char16_t* s, size_t len)
+{
+    static const utf8_length_kernel count = select_utf8_length_kernel();
+    const char16_t* p = s;
+    const char16_t* end = s + len;
+    size_t n = count(p, end);
+    for (; p < end; ++p)
+        n += utf8_length_of_unit(*p);
+    return n;
+}
+
+// Resizes s to n characters, lets write(s.data(), n) fill them, and truncates s to the length
+// returned by write. The characters are not zero-initialized first if the standard library
+// supports resize_and_overwrite. write must not throw.
+template <class String, class Writer>
+static void u8_resize_and_overwrite(String& s, size_t n, Writer write)
+{
+#ifdef __cpp_lib_string_resize_and_overwrite
+    s.resize_and_overwrite(n, [&](typename String::value_type* p, size_t m) { return write(p, m); });
+#else
+    // Grow by appending zeros instead of calling resize(n). libstdc++ implements resize with a
+    // loop that stores one character at a time, and gcc vectorizes that loop only at -O3 or with
+    // -ftree-loop-vectorize. At -O2, filling a char16_t string that way costs several times more
+    // than the simd conversion that overwrites it. append copies from a zero array with memcpy.
+    static const typename String::value_type zeros[4096] = {};
+    if (s.size() < n)
+    {
+        s.reserve(n);
+        while (s.size() < n)
+            s.append(zeros, n - s.size() < 4096 ? n - s.size() : 4096);
+    }
+    s.resize(write(&s[0], n));
+#endif
+}
+
+// The single pass conversions reserve for the worst case, up to 4 times the converted length.
+// Strings returned by value give back all but a few unused characters, so that a caller who
+// keeps many of them does not hold on to the worst case; the _into and _append functions keep
+// the capacity for the next call.
+static const size_t u8_shrink_slack = 16;
+
+template <class String>
+static void u8_shrink_to_fit(String& s)
+{
+    if (s.capacity() - s.size() > u8_shrink_slack)
+        s.shrink_to_fit();
+}
+
+// Replaces out from position pos on by the conversion. String is std::u16string, or std::wstring
+// on windows where wchar_t holds utf-16.
+template <class String>
+static u8_conversion_result utf8_to_utf16_at(const char* s, size_t len, String& out, size_t pos, bool replace_inv_chars)
+{
+    // utf-8 never needs more utf-16 code units than bytes, so a single pass suffices.
+    u8_conversion_result result;
+    u8_resize_and_overwrite(out, pos + len, [&](typename String::value_type* p, size_t) -> size_t
+    {
+        result = utf8_to_utf16<false>(s, len, reinterpret_cast<char16_t*>(p + pos), len, replace_inv_chars);
+        return pos + result.output_written;
+    });
+    return result;
+}
+
+template <class Char>
+static u8_conversion_result utf16_to_utf8_at(const Char* s, size_t len, std::string& out, size_t pos, bool replace_inv_chars)
+{
+    // a utf-16 code unit never needs more than 3 bytes, so a single pass suffices.
+    u8_conversion_result result;
+    u8_resize_and_overwrite(out, pos + 3 * len, [&](char* p, size_t) -> size_t
+    {
+        result = utf16_to_utf8<false>(reinterpret_cast<const char16_t*>(s), len, p + pos, 3 * len, replace_inv_chars);
+        return pos + result.output_written;
+    });
+    return result;
+}
+
+template <class String>
+static u8_conversion_result utf8_to_utf16_append(const char* s, size_t len, String& out, bool replace_inv_chars)
+{
+    return utf8_to_utf16_at(s, len, out, out.size(), replace_inv_chars);
+}
+
+template <class Char>
+static u8_conversion_result utf16_to_utf8_append(const Char* s, size_t len, std::string& out, bool replace_inv_chars)
+{
+    return utf16_to_utf8_at(s, len, out, out.size(), replace_inv_chars);
+}
+
+// Overwrite out instead of clearing it. After clear() every character up to the new size would be
+// initialized again, while a string reused for inputs of similar length already holds enough
+// initialized characters and only needs to be truncated to the converted length.
+template <class String>
+static u8_conversion_result utf8_to_utf16_into(const char* s, size_t len, String& out, bool replace_inv_chars)
+{
+    return utf8_to_utf16_at(s, len, out, 0, replace_inv_chars);
+}
+
+template <class Char>
+static u8_conversion_result utf16_to_utf8_into(const Char* s, size_t len, std::string& out, bool replace_inv_chars)
+{
+    return utf16_to_utf8_at(s, len, out, 0, replace_inv_chars);
+}
+
+// Throws a U8ConversionError if the conversion stopped at invalid input. The offset of the
+// invalid input is appended to message.
+static void u8_check_conversion(const u8_conversion_result& result, const char* message)
+{
+    if (result.status != u8_conversion_status::ok)
+    {
+#if LIBPU8_INSTRUMENT
+        u8_count_event(u8_stats_event::exception);
+#endif
+        throw U8ConversionError(message + std::to_string(result.error_offset) + ".");
+    }
+}
+
+template <class String>
+static String utf8_to_utf16_string(const char* s, size_t len, bool throw_on_inv_chars)
+{
+    String out;
+    u8_check_conversion(utf8_to_utf16_into(s, len, out, !throw_on_inv_chars),
+        "utf8 to utf16 conversion failed: invalid utf8 sequence at byte offset ");
+    u8_shrink_to_fit(out);
+    return out;
+}
+
+// Counting the bytes first and converting into a string of exactly that size is faster than
+// converting into 3 * len bytes and giving the rest back, which reallocates and copies the string
+// (see bench_narrow). The count is exact up to the first invalid code unit, but an unpaired
+// surrogate counts 2 bytes and is replaced by 3, so a lossy conversion may have to append the rest.
+template <class Char>
+static std::string utf16_to_utf8_string(const Char* s, size_t len, bool throw_on_inv_chars)
+{
+    const char16_t* s16 = reinterpret_cast<const char16_t*>(s);
+    std::string out;
+    u8_conversion_result result;
+    u8_resize_and_overwrite(out, u16to8_length(s16, len), [&](char* p, size_t n) -> size_t
+    {
+        result = utf16_to_utf8<true>(s16, len, p, n, !throw_on_inv_chars);
+        return result.output_written;
+    });
+    if (result.status == u8_conversion_status::output_too_small)
+    {
+        size_t done = result.input_consumed;
+        result = utf16_to_utf8_append(s16 + done, len - done, out, !throw_on_inv_chars);
+        result.input_consumed += done;
+        result.error_offset += done;
+        u8_shrink_to_fit(out);
+    }
+    u8_check_conversion(result, "utf16 to utf8 conversion failed: unpaired surrogate at code unit offset ");
+    return out;
+}
+
+std::u16string u8to16(const char* s, size_t len, bool throw_on_inv_chars)
+{
+    return utf8_to_utf16_string<std::u16string>(s, len, throw_on_inv_chars);
+}
+
+std::string u16to8(const char16_t* s, size_t len, bool throw_on_inv_chars)
+{
+    return utf16_to_utf8_string(s, len, throw_on_inv_chars);
+}
+
+u8_conversion_result u8to16_into(const char* s, size_t len, std::u16string& out, bool replace_inv_chars)
+{
+    return utf8_to_utf16_into(s, len, out, replace_inv_chars);
+}
+
+u8_conversion_result u16to8_into(const char16_t* s, size_t len, std::string& out, bool replace_inv_chars)
+{
+    return utf16_to_utf8_into(s, len, out, replace_inv_chars);
+}
+
+u8_conversion_result u8to16_into(const char* s, size_t len, char16_t* out, size_t out_capacity, bool replace_inv_chars)
+{
+    return out_capacity >= len ? utf8_to_utf16<false>(s, len, out, out_capacity, replace_inv_chars)
+        : utf8_to_utf16<true>(s, len, out, out_capacity, replace_inv_chars);
+}
+
+u8_conversion_result u16to8_into(const char16_t* s, size_t len, char* out, size_t out_capacity, bool replace_inv_chars)
+{
+    return out_capacity / 3 >= len ? utf16_to_utf8<false>(s, len, out, out_capacity, replace_inv_chars)
+        : utf16_to_utf8<true>(s, len, out, out_capacity, replace_inv_chars);
+}
+
+u8_conversion_result u8to16_append(const char* s, size_t len, std::u16string& out, bool replace_inv_chars)
+{
+    return utf8_to_utf16_append(s, len, out, replace_inv_chars);
+}
+
+// Replaces out by the conversion, like the _into functions above. convert(p, n) writes at most n
+// code units to p.
+template <class String, class Converter>
+static u8_conversion_result u8_convert_into(String& out, size_t n, Converter convert)
+{
+    u8_conversion_result result;
+    u8_resize_and_overwrite(out, n, [&](typename String::value_type* p, size_t) -> size_t
+    {
+        result = convert(p, n);
+        return result.output_written;
+    });
+    return result;
+}
+
+std::u32string u8to32(const char* s, size_t len, bool throw_on_inv_chars)
+{
+    std::u32string out;
+    u8_check_conversion(u8to32_into(s, len, out, !throw_on_inv_chars),
+        "utf8 to utf32 conversion failed: invalid utf8 sequence at byte offset ");
+    u8_shrink_to_fit(out);
+    return out;
+}
+
+std::string u32to8(const char32_t* s, size_t len, bool throw_on_inv_chars)
+{
+    std::string out;
+    u8_check_conversion(u32to8_into(s, len, out, !throw_on_inv_chars),
+        "utf32 to utf8 conversion failed: invalid code point at offset ");
+    u8_shrink_to_fit(out);
+    return out;
+}
+
+std::u32string u16to32(const char16_t* s, size_t len, bool throw_on_inv_chars)
+{
+    std::u32string out;
+    u8_check_conversion(u16to32_into(s, len, out, !throw_on_inv_chars),
+        "utf16 to utf32 conversion failed: unpaired surrogate at code unit offset ");
+    u8_shrink_to_fit(out);
+    return out;
+}
+
+std::u16string u32to16(const char32_t* s, size_t len, bool throw_on_inv_chars)
+{
+    std::u16string out;
+    u8_check_conversion(u32to16_into(s, len, out, !throw_on_inv_chars),
+        "utf32 to utf16 conversion failed: invalid code point at offset ");
+    u8_shrink_to_fit(out);
+    return out;
+}
+
+// utf-8 and utf-16 never need more utf-32 code points than code units, a code point never needs
+// more than 4 bytes or 2 utf-16 code units, so a single pass suffices.
+
+u8_conversion_result u8to32_into(const char* s, size_t len, std::u32string& out, bool replace_inv_chars)
+{
+    return u8_convert_into(out, len, [&](char32_t* p, size_t n)
+    {
+        return utf8_to_utf32<false>(s, len, p, n, replace_inv_chars);
+    });
+}
+
+u8_conversion_result u32to8_into(const char32_t* s, size_t len, std::string& out, bool replace_inv_chars)
+{
+    return u8_convert_into(out, 4 * len, [&](char* p, size_t n)
+    {
+        return utf32_to_utf8<false>(s, len, p, n, replace_inv_chars);
+    });
+}
+
+u8_conversion_result u16to32_into(const char16_t* s, size_t len, std::u32string& out, bool replace_inv_chars)
+{
+    return u8_convert_into(out, len, [&](char32_t* p, size_t n)
+    {
+        return utf16_to_utf32<false>(s, len, p, n, replace_inv_chars);
+    });
+}
+
+u8_conversion_result u32to16_into(const char32_t* s, size_t len, std::u16string& out, bool replace_inv_chars)
+{
+    return u8_convert_into(out, 2 * len, [&](char16_t* p, size_t n)
+    {
+        return utf32_to_utf16<false>(s, len, p, n, replace_inv_chars);
+    });
+}
+
+u8_conversion_result u8to32_into(const char* s, size_t len, char32_t* out, size_t out_capacity, bool replace_inv_chars)
+{
+    return out_capacity >= len ? utf8_to_utf32<false>(s, len, out, out_capacity, replace_inv_chars)
+        : utf8_to_utf32<true>(s, len, out, out_capacity, replace_inv_chars);
+}
+
+u8_conversion_result u32to8_into(const char32_t* s, size_t len, char* out, size_t out_capacity, bool replace_inv_chars)
+{
+    return out_capacity / 4 >= len ? utf32_to_utf8<false>(s, len, out, out_capacity, replace_inv_chars)
+        : utf32_to_utf8<true>(s, len, out, out_capacity, replace_inv_chars);
+}
+
+u8_conversion_result u16to32_into(const char16_t* s, size_t len, char32_t* out, size_t out_capacity, bool replace_inv_chars)
+{
+    return out_capacity >= len ? utf16_to_utf32<false>(s, len, out, out_capacity, replace_inv_chars)
+        : utf16_to_utf32<true>(s, len, out, out_capacity, replace_inv_chars);
+}
+
+u8_conversion_result u32to16_into(const char32_t* s, size_t len, char16_t* out, size_t out_capacity, bool replace_inv_chars)
+{
+    return out_capacity / 2 >= len ? utf32_to_utf16<false>(s, len, out, out_capacity, replace_inv_chars)
+        : utf32_to_utf16<true>(s, len, out, out_capacity, replace_inv_chars);
+}
+
+u8_conversion_result U8StreamDecoder::decode(const char* s, size_t len, char16_t* out)
+{
+    const unsigned char* begin = reinterpret_cast<const unsigned char*>(s);
+    const unsigned char* p = begin;
+    const unsigned char* end = begin + len;
+    char16_t* o = out;
+    if (m_carry_size)
+    {
+        // complete the carried sequence with the first bytes of this chunk
+        unsigned char seq[4];
+        std::memcpy(seq, m_carry, m_carry_size);
+        size_t taken = len < 4 - m_carry_size ? len : 4 - m_carry_size;
+        std::memcpy(seq + m_carry_size, p, taken);
+        size_t n = m_carry_size + taken;
+        if (utf8_incomplete_tail(seq, seq + n) == n)
+        {
+            std::memcpy(m_carry, seq, n);
+            m_carry_size = n;
+            return u8_make_result(u8_conversion_status::ok, len, 0, len);
+        }
+        // the carry is a valid prefix, so the code point or maximal subpart includes all of it
+        const unsigned char* q = seq;
+        uint32_t cp = decode_utf8(q, seq + n);
+        p += size_t(q - seq) - m_carry_size;
+        m_carry_size = 0;
+        if (cp == u8_invalid_cp)
+        {
+            if (!m_replace_inv_chars)
+                return u8_make_result(u8_conversion_status::invalid_input, size_t(p - begin), 0, 0);
+            *o++ = u8_replacement_char;
+        }
+        else if (cp < 0x10000)
+            *o++ = char16_t(cp);
+        else
+        {
+            cp -= 0x10000;
+            *o++ = char16_t(0xD800 + (cp >> 10));
+            *o++ = char16_t(0xDC00 + (cp & 0x3FF));
+        }
+    }
+    size_t tail = utf8_incomplete_tail(p, end);
+    size_t n = size_t(end - p) - tail;
+    u8_conversion_result result = utf8_to_utf16<false>(reinterpret_cast<const char*>(p), n, o, n,
+        m_replace_inv_chars);
+    size_t offset = size_t(p - begin);
+    result.input_consumed += offset;
+    result.error_offset += offset;
+    result.output_written += size_t(o - out);
+    if (result.status == u8_conversion_status::ok)
+    {
+        std::memcpy(m_carry, end - tail, tail);
+        m_carry_size = tail;
+        result.input_consumed = len;
+        result.error_offset = len;
+    }
+    return result;
+}
+
+u8_conversion_result U8StreamDecoder::decode(const char* s, size_t len, std::u16string& out)
+{
+    u8_conversion_result result;
+    size_t pos = out.size();
+    u8_resize_and_overwrite(out, pos + len + 1, [&](char16_t* p, size_t) -> size_t
+    {
+        result = decode(s, len, p + pos);
+        return pos + result.output_written;
+    });
+    return result;
+}
+
+u8_conversion_result U8StreamEncoder::encode(const char16_t* s, size_t len, char* out)
+{
+    const char16_t* p = s;
+    const char16_t* end = s + len;
+    unsigned char* o = reinterpret_cast<unsigned char*>(out);
+    if (m_high_surrogate && p < end)
+    {
+        uint32_t u = m_high_surrogate;
+        m_high_surrogate = 0;
+        if ((*p & 0xFC00) == 0xDC00)
+        {
+            uint32_t cp = 0x10000 + ((u - 0xD800) << 10) + (*p++ - 0xDC00);
+            *o++ = (unsigned char)(0xF0 | (cp >> 18));
+            *o++ = (unsigned char)(0x80 | ((cp >> 12) & 0x3F));
+            *o++ = (unsigned char)(0x80 | ((cp >> 6) & 0x3F));
+            *o++ = (unsigned char)(0x80 | (cp & 0x3F));
+        }
+        else if (!m_replace_inv_chars)
+            return u8_make_result(u8_conversion_status::invalid_input, 0, 0, 0);
+        else
+        {
+            *o++ = 0xEF;
+            *o++ = 0xBF;
+            *o++ = 0xBD;
+        }
+    }
+    size_t n = size_t(end - p);
+    if (n && (end[-1] & 0xFC00) == 0xD800)
+        --n;
+    u8_conversion_result result = utf16_to_utf8<false>(p, n, reinterpret_cast<char*>(o), 3 * n,
+        m_replace_inv_chars);
+    size_t offset = size_t(p - s);
+    result.input_consumed += offset;
+    result.error_offset += offset;
+    result.output_written += size_t(o - reinterpret_cast<unsigned char*>(out));
+    if (result.status == u8_conversion_status::ok)
+    {
+        if (p + n < end)
+            m_high_surrogate = end[-1];
+        result.input_consumed = len;
+        result.error_offset = len;
+    }
+    return result;
+}
+
+u8_conversion_result U8StreamEncoder::encode(const char16_t* s, size_t len, std::string& out)
+{
+    u8_conversion_result result;
+    size_t pos = out.size();
+    u8_resize_and_overwrite(out, pos + 3 * len + 3, [&](char* p, size_t) -> size_t
+    {
+        result = encode(s, len, p + pos);
+        return pos + result.output_written;
+    });
+    return result;
+}
+
+u8_conversion_result U8StreamEncoder::finish(char* out)
+{
+    if (!m_high_surrogate)
+        return u8_make_result(u8_conversion_status::ok, 0, 0, 0);
+    m_high_surrogate = 0;
+    if (!m_replace_inv_chars)
+        return u8_make_result(u8_conversion_status::invalid_input, 0, 0, 0);
+    out[0] = char(0xEF);
+    out[1] = char(0xBF);
+    out[2] = char(0xBD);
+    return u8_make_result(u8_conversion_status::ok, 0, 3, 0);
+}
+
+u8_conversion_result U8StreamDecoder::finish(char16_t* out)
+{
+    if (!m_carry_size)
+        return u8_make_result(u8_conversion_status::ok, 0, 0, 0);
+    m_carry_size = 0;
+    if (!m_replace_inv_chars)
+        return u8_make_result(u8_conversion_status::invalid_input, 0, 0, 0);
+    *out = u8_replacement_char;
+    return u8_make_result(u8_conversion_status::ok, 0, 1, 0);
+}
+
+u8_conversion_result u16to8_append(const char16_t* s, size_t len, std::string& out, bool replace_inv_chars)
+{
+    return utf16_to_utf8_append(s, len, out, replace_inv_chars);
+}
+
+
 #ifdef _WIN32
 
-#include "libpu8.h"
+static_assert(sizeof(wchar_t) == sizeof(char16_t), "wchar_t must hold utf-16 code units");
 
-#include <cstdint>
+#if LIBPU8_USE_WIN32_CONVERSION
 
 std::wstring u8widen(const char* s, size_t len, bool throw_on_inv_chars)
 {
+    // how many replacement characters windows writes for an invalid sequence depends on its
+    // version, so replace like on every other platform
+    if (!throw_on_inv_chars)
+        return utf8_to_utf16_string<std::wstring>(s, len, false);
     if (!len)
         return std::wstring();
     if (len < size_t(INT_MAX))
     {
         int ilen = int(len);
-        DWORD flags = throw_on_inv_chars ? MB_ERR_INVALID_CHARS : 0;
-        int num_wchars = MultiByteToWideChar(CP_UTF8, flags, s, ilen, 0, 0);
-        if (num_wchars > 0)
-        {
-            std::wstring result;
-            result.resize(size_t(num_wchars));
-            wchar_t* pout = const_cast<wchar_t*>(result.data());
-            MultiByteToWideChar(CP_UTF8, flags, s, ilen, pout, int(result.size()));
+        DWORD flags = MB_ERR_INVALID_CHARS;
+        // utf-8 never needs more wchars than bytes, so a single call into a buffer of len wchars
+        // suffices instead of a sizing call followed by the conversion.
+        std::wstring result;
+        u8_resize_and_overwrite(result, len, [&](wchar_t* pout, size_t) -> size_t
+        {
+            return size_t(MultiByteToWideChar(CP_UTF8, flags, s, ilen, pout, ilen));
+        });
+        u8_shrink_to_fit(result);
+        if (!result.empty())
             return result;
-        }
     }
+#if LIBPU8_INSTRUMENT
+    u8_count_event(u8_stats_event::exception);
+#endif
     throw U8ConversionError("utf8 to wide-string conversion failed.");
 }
 
 std::string u8narrow(const wchar_t *s, size_t len, bool throw_on_inv_chars)
 {
+    if (!throw_on_inv_chars)
+        return utf16_to_utf8_string(s, len, false);
     if (!len)
         return std::string();
     if (len < size_t(INT_MAX))
     {
         int ilen = int(len);
-        DWORD flags = throw_on_inv_chars ? WC_ERR_INVALID_CHARS : 0;
-        int utf8_bytes = WideCharToMultiByte(CP_UTF8, flags, s, ilen, 0, 0, 0, 0);
+        DWORD flags = WC_ERR_INVALID_CHARS;
+        // a wchar never needs more than 3 bytes, so a single call into a buffer of 3 * len bytes
+        // suffices instead of a sizing call followed by the conversion.
+        // Only huge strings whose worst case does not fit into an int need the sizing call.
+        int utf8_bytes = len < size_t(INT_MAX / 3) ? int(3 * len)
+            : WideCharToMultiByte(CP_UTF8, flags, s, ilen, 0, 0, 0, 0);
         if (utf8_bytes > 0)
         {
             std::string result;
-            result.resize(size_t(utf8_bytes));
-            char* pout = const_cast<char*>(result.data());
-            WideCharToMultiByte(CP_UTF8, flags, s, ilen, pout, utf8_bytes, 0, 0);
-            return result;
+            u8_resize_and_overwrite(result, size_t(utf8_bytes), [&](char* pout, size_t n) -> size_t
+            {
+                return size_t(WideCharToMultiByte(CP_UTF8, flags, s, ilen, pout, int(n), 0, 0));
+            });
+            u8_shrink_to_fit(result);
+            if (!result.empty())
+                return result;
         }
     }
+#if LIBPU8_INSTRUMENT
+    u8_count_event(u8_stats_event::exception);
+#endif
     throw U8ConversionError("wide-string to utf8 conversion failed.");
 }
 
-unsigned num_succeeding_bytes(unsigned char c)
+#else
+
+std::wstring u8widen(const char* s, size_t len, bool throw_on_inv_chars)
 {
-    switch (c >> 5)
-    {
-    case 0:
-    case 1:
-    case 2:
-    case 3:
-        // ascii byte
-        return 0;
-    case 4:
-    case 5:
-        assert(false); // this is a continuation byte
-        return 0;
-    case 6:
-        return 1;
-    case 7:
-        if (c & (1 << 5))
-            return 3;
-        return 2;
-    default:
-        assert(false);
-        return unsigned(-1);
-    }
+    return utf8_to_utf16_string<std::wstring>(s, len, throw_on_inv_chars);
 }
 
-
-U8ConsoleIstreamBufWin32::int_type U8ConsoleIstreamBufWin32::underflow()
+std::string u8narrow(const wchar_t *s, size_t len, bool throw_on_inv_chars)
 {
-    if (gptr() >= egptr())
-    {
-        wchar_t wideBuffer[128];
-        DWORD readSize;
-        if (!::ReadConsoleW(m_handle, wideBuffer, ARRAYSIZE(wideBuffer) - 2, &readSize, NULL))
-            return traits_type::eof();
-        if (readSize > 0 && IS_HIGH_SURROGATE(wideBuffer[readSize - 1]))
-        {
-            // try to read one more character
-            DWORD extraReadSize;
-            if (::ReadConsoleW(m_handle, wideBuffer + readSize, 1, &extraReadSize, NULL) && extraReadSize == 1)
-                ++readSize;
-        }
+    return utf16_to_utf8_string(s, len, throw_on_inv_chars);
+}
 
-        wideBuffer[readSize] = L'\0';
-        m_buffer = u8narrow(wideBuffer);
+#endif // LIBPU8_USE_WIN32_CONVERSION
 
-        setg(&m_buffer[0], &m_buffer[0], &m_buffer[0] + m_buffer.size());
+u8_conversion_result u8widen_into(const char* s, size_t len, std::wstring& out, bool replace_inv_chars)
+{
+    return utf8_to_utf16_into(s, len, out, replace_inv_chars);
+}
 
-        if (gptr() >= egptr())
-        {
-            return traits_type::eof();
-        }
-    }
+u8_conversion_result u8narrow_into(const wchar_t *s, size_t len, std::string& out, bool replace_inv_chars)
+{
+    return utf16_to_utf8_into(s, len, out, replace_inv_chars);
+}
 
-    return sgetc();
+size_t u8widen_length(const char* s, size_t len)
+{
+    return u8to16_length(s, len);
+}
 
+size_t u8narrow_length(const wchar_t *s, size_t len)
+{
+    return u16to8_length(reinterpret_cast<const char16_t*>(s), len);
 }
 
+u8_conversion_result u8widen_into(const char* s, size_t len, wchar_t* out, size_t out_capacity, bool replace_inv_chars)
+{
+    return u8to16_into(s, len, reinterpret_cast<char16_t*>(out), out_capacity, replace_inv_chars);
+}
 
-int U8ConsoleOstreamBufWin32::sync()
+u8_conversion_result u8narrow_into(const wchar_t *s, size_t len, char* out, size_t out_capacity, bool replace_inv_chars)
 {
-    std::string buffer = m_unwritten_partial_bytes + str();
-    size_t partial_trailing = num_trailing_partial_bytes(buffer);
-    m_unwritten_partial_bytes = std::string(buffer.end() - partial_trailing, buffer.end());
-    str(""); // clear stringbuf's buffer
-    buffer.resize(buffer.size() - partial_trailing);
-    if (buffer.empty())
-        return 0;
+    return u16to8_into(reinterpret_cast<const char16_t*>(s), len, out, out_capacity, replace_inv_chars);
+}
 
-    std::wstring wideBuffer = u8widen(buffer);
-    DWORD writtenSize;
-    ::WriteConsoleW(m_handle, wideBuffer.c_str(), DWORD(wideBuffer.size()), &writtenSize, NULL);
+U8NativePath::U8NativePath(const char* s, size_t len, bool throw_on_inv_chars)
+{
+    u8_conversion_result result = u8to16_into(s, len, reinterpret_cast<char16_t*>(m_buffer), inline_capacity - 1,
+        !throw_on_inv_chars);
+    if (result.status == u8_conversion_status::ok)
+    {
+        m_buffer[result.output_written] = 0;
+        m_size = result.output_written;
+    }
+    else
+    {
+        // too long for the buffer, or invalid, which throws
+        m_heap = utf8_to_utf16_string<std::wstring>(s, len, throw_on_inv_chars);
+        m_size = m_heap.size();
+    }
+}
 
-    return 0;
+u8_conversion_result u8widen_append(const char* s, size_t len, std::wstring& out, bool replace_inv_chars)
+{
+    return utf8_to_utf16_append(s, len, out, replace_inv_chars);
 }
-size_t U8ConsoleOstreamBufWin32::num_trailing_partial_bytes(const std::string& s)
+
+u8_conversion_result u8narrow_append(const wchar_t *s, size_t len, std::string& out, bool replace_inv_chars)
 {
-    if (s.empty())
-        return 0;
-    if (is_utf8_leading(*s.rbegin()))
-        return 1;
-    size_t result = 0;
-    // skip any trailing continuation bytes
-    while (result < s.size() && is_utf8_continuation(s[s.size() - result - 1]))
-        ++result;
-    if (result && result < s.size())
-    {
-        // there is a non-continuation byte left
-        if (num_succeeding_bytes(s[s.size() - result - 1]) == result)
-            return 0; // s ends with a complete multi-byte sequence
-        // s ends with an incomplete multi-byte sequence
-        ++result;
-    }
-    return result;
+    return utf16_to_utf8_append(s, len, out, replace_inv_chars);
 }
 
 #endif //_WIN32
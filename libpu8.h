@@ -19,7 +19,13 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 Enables portable utf-8. See also http://utf8everywhere.org/
 
 Defines the functions u8widen and u8narrow that convert between utf-8 and wchar_t on windows
-and do nothing elsewhere.
+and do nothing elsewhere. u8widen_view is like u8widen, but does not copy the string on other
+systems.
+Defines the functions u8to16 and u16to8 that convert between utf-8 and utf-16 (char16_t) on every
+platform. They do not depend on the OS and use simd instructions if the cpu supports them.
+On windows, define LIBPU8_USE_WIN32_CONVERSION to 0 to make u8widen and u8narrow use them instead
+of MultiByteToWideChar and WideCharToMultiByte.
+Defines u8to32, u32to8, u16to32 and u32to16 that convert to and from utf-32 (char32_t) in the same way.
 Defines the macro main_utf8 that can be used instead of main.
 main_utf8 will then be called with utf8 arguments.
 
@@ -38,7 +44,7 @@ Usage example: my_main.cpp:
 // argv are utf-8 strings
 int main_utf8(int argc, char** argv)
 {
-  std::ofstream f(u8widen(argv[1])); // will also work on a non-windows OS that supports utf-8 natively
+  std::ofstream f(u8widen_view(argv[1])); // will also work on a non-windows OS that supports utf-8 natively
   if (!f)
     MessageBoxW(0, u8widen(string("Failed to open file ") + argv[1] + " for writing").c_str(), 0, 0);
   std::string line;
@@ -59,6 +65,16 @@ You need to use C++ fstream.
 #include <sstream>
 #include <iostream>
 #include <stdexcept>
+#include <streambuf>
+#include <cstring>
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#include <string_view>
+#if defined(__has_include)
+#if __has_include(<filesystem>)
+#include <filesystem>
+#endif
+#endif
+#endif
 
 class U8ConversionError : public std::runtime_error
 {
@@ -66,22 +82,657 @@ public:
     U8ConversionError(const std::string& s) : std::runtime_error(s) {}
 };
 
+static const bool u8_default_throw = true;
+
+// u8to16 and u16to8 throw a U8ConversionError if conversion failed and if throw_on_inv_chars is true.
+// If throw_on_inv_chars is false, then invalid characters are replaced by U+FFFD: one for each
+// maximal subpart of an ill-formed utf-8 sequence, as the WHATWG encoding standard and the unicode
+// standard recommend (e.g. "\xE2\x82" gives one U+FFFD, "\xC0\xAF" two), and one for each unpaired
+// surrogate. All functions of this library replace the same way on every platform, U8StreamDecoder
+// too, wherever the chunks are split.
+
+std::u16string u8to16(const char* s, size_t len, bool throw_on_inv_chars = u8_default_throw);
+
+inline std::u16string u8to16(const std::string& s, bool throw_on_inv_chars = u8_default_throw)
+{
+    return u8to16(s.data(), s.size(), throw_on_inv_chars);
+}
+inline std::u16string u8to16(const char* s, bool throw_on_inv_chars = u8_default_throw)
+{
+    return u8to16(s, std::strlen(s), throw_on_inv_chars);
+}
+
+
+std::string u16to8(const char16_t* s, size_t len, bool throw_on_inv_chars = u8_default_throw);
+
+inline std::string u16to8(const char16_t* s, bool throw_on_inv_chars = u8_default_throw)
+{
+    return u16to8(s, std::char_traits<char16_t>::length(s), throw_on_inv_chars);
+}
+inline std::string u16to8(const std::u16string& s, bool throw_on_inv_chars = u8_default_throw)
+{
+    return u16to8(s.data(), s.size(), throw_on_inv_chars);
+}
+
+#ifdef __cpp_lib_string_view
+inline std::u16string u8to16(std::string_view s, bool throw_on_inv_chars = u8_default_throw)
+{
+    return u8to16(s.data(), s.size(), throw_on_inv_chars);
+}
+inline std::string u16to8(std::u16string_view s, bool throw_on_inv_chars = u8_default_throw)
+{
+    return u16to8(s.data(), s.size(), throw_on_inv_chars);
+}
+#endif
+
+#ifdef __cpp_lib_char8_t
+inline std::u16string u8to16(std::u8string_view s, bool throw_on_inv_chars = u8_default_throw)
+{
+    return u8to16(reinterpret_cast<const char*>(s.data()), s.size(), throw_on_inv_chars);
+}
+#endif
+
+enum class u8_conversion_status
+{
+    ok,
+    invalid_input,   // an invalid utf-8 sequence or an unpaired utf-16 surrogate
+    output_too_small // the next code point does not fit into the output buffer
+};
+
+struct u8_conversion_result
+{
+    u8_conversion_status status;
+    size_t input_consumed;  // includes the invalid sequence, so conversion can resume from here
+    size_t output_written;
+    size_t error_offset;    // start of the invalid sequence, where the output buffer ran full,
+                            // or the input length if status is ok
+};
+
+// The _into functions do not throw on invalid input. They write the converted input to out,
+// reusing its capacity. If replace_inv_chars is false, they stop in front of the first invalid
+// sequence: out then holds the conversion of everything before it. If replace_inv_chars is true,
+// invalid sequences are replaced by U+FFFD and the status is always ok.
+
+u8_conversion_result u8to16_into(const char* s, size_t len, std::u16string& out, bool replace_inv_chars = !u8_default_throw);
+
+u8_conversion_result u16to8_into(const char16_t* s, size_t len, std::string& out, bool replace_inv_chars = !u8_default_throw);
+
+// string_views replace the string overloads, which would make string literal arguments ambiguous
+#ifdef __cpp_lib_string_view
+inline u8_conversion_result u8to16_into(std::string_view s, std::u16string& out, bool replace_inv_chars = !u8_default_throw)
+{
+    return u8to16_into(s.data(), s.size(), out, replace_inv_chars);
+}
+inline u8_conversion_result u16to8_into(std::u16string_view s, std::string& out, bool replace_inv_chars = !u8_default_throw)
+{
+    return u16to8_into(s.data(), s.size(), out, replace_inv_chars);
+}
+#else
+inline u8_conversion_result u8to16_into(const std::string& s, std::u16string& out, bool replace_inv_chars = !u8_default_throw)
+{
+    return u8to16_into(s.data(), s.size(), out, replace_inv_chars);
+}
+inline u8_conversion_result u16to8_into(const std::u16string& s, std::string& out, bool replace_inv_chars = !u8_default_throw)
+{
+    return u16to8_into(s.data(), s.size(), out, replace_inv_chars);
+}
+#endif
+
+// Convert into a buffer of out_capacity code units. Nothing is allocated. If the output does not
+// fit, the status is output_too_small and input_consumed tells where to continue. A buffer of
+// len code units always suffices for u8to16_into, and of 3 * len bytes for u16to8_into.
+
+u8_conversion_result u8to16_into(const char* s, size_t len, char16_t* out, size_t out_capacity, bool replace_inv_chars = !u8_default_throw);
+
+u8_conversion_result u16to8_into(const char16_t* s, size_t len, char* out, size_t out_capacity, bool replace_inv_chars = !u8_default_throw);
+
+// Append to out, reusing its capacity. output_written counts the appended code units only.
+
+u8_conversion_result u8to16_append(const char* s, size_t len, std::u16string& out, bool replace_inv_chars = !u8_default_throw);
+
+inline u8_conversion_result u8to16_append(const std::string& s, std::u16string& out, bool replace_inv_chars = !u8_default_throw)
+{
+    return u8to16_append(s.data(), s.size(), out, replace_inv_chars);
+}
+
+u8_conversion_result u16to8_append(const char16_t* s, size_t len, std::string& out, bool replace_inv_chars = !u8_default_throw);
+
+inline u8_conversion_result u16to8_append(const std::u16string& s, std::string& out, bool replace_inv_chars = !u8_default_throw)
+{
+    return u16to8_append(s.data(), s.size(), out, replace_inv_chars);
+}
+
+// Return the exact length that u8to16 and u16to8 produce for valid input, without converting.
+// Useful to size buffers for the _into functions. For invalid input the result is meaningless.
+
+size_t u8to16_length(const char* s, size_t len);
+
+inline size_t u8to16_length(const std::string& s)
+{
+    return u8to16_length(s.data(), s.size());
+}
+
+size_t u16to8_length(const char16_t* s, size_t len);
+
+inline size_t u16to8_length(const std::u16string& s)
+{
+    return u16to8_length(s.data(), s.size());
+}
+
+// u8to32, u32to8, u16to32 and u32to16 convert to and from utf-32 (char32_t), one code point per
+// element. Invalid input is handled like in u8to16 and u16to8; in utf-32, surrogates and values
+// above U+10FFFF are invalid and each is replaced by one U+FFFD.
+
+std::u32string u8to32(const char* s, size_t len, bool throw_on_inv_chars = u8_default_throw);
+
+inline std::u32string u8to32(const std::string& s, bool throw_on_inv_chars = u8_default_throw)
+{
+    return u8to32(s.data(), s.size(), throw_on_inv_chars);
+}
+inline std::u32string u8to32(const char* s, bool throw_on_inv_chars = u8_default_throw)
+{
+    return u8to32(s, std::strlen(s), throw_on_inv_chars);
+}
+
+std::string u32to8(const char32_t* s, size_t len, bool throw_on_inv_chars = u8_default_throw);
+
+inline std::string u32to8(const char32_t* s, bool throw_on_inv_chars = u8_default_throw)
+{
+    return u32to8(s, std::char_traits<char32_t>::length(s), throw_on_inv_chars);
+}
+inline std::string u32to8(const std::u32string& s, bool throw_on_inv_chars = u8_default_throw)
+{
+    return u32to8(s.data(), s.size(), throw_on_inv_chars);
+}
+
+std::u32string u16to32(const char16_t* s, size_t len, bool throw_on_inv_chars = u8_default_throw);
+
+inline std::u32string u16to32(const char16_t* s, bool throw_on_inv_chars = u8_default_throw)
+{
+    return u16to32(s, std::char_traits<char16_t>::length(s), throw_on_inv_chars);
+}
+inline std::u32string u16to32(const std::u16string& s, bool throw_on_inv_chars = u8_default_throw)
+{
+    return u16to32(s.data(), s.size(), throw_on_inv_chars);
+}
+
+std::u16string u32to16(const char32_t* s, size_t len, bool throw_on_inv_chars = u8_default_throw);
+
+inline std::u16string u32to16(const char32_t* s, bool throw_on_inv_chars = u8_default_throw)
+{
+    return u32to16(s, std::char_traits<char32_t>::length(s), throw_on_inv_chars);
+}
+inline std::u16string u32to16(const std::u32string& s, bool throw_on_inv_chars = u8_default_throw)
+{
+    return u32to16(s.data(), s.size(), throw_on_inv_chars);
+}
+
+#ifdef __cpp_lib_string_view
+inline std::u32string u8to32(std::string_view s, bool throw_on_inv_chars = u8_default_throw)
+{
+    return u8to32(s.data(), s.size(), throw_on_inv_chars);
+}
+inline std::string u32to8(std::u32string_view s, bool throw_on_inv_chars = u8_default_throw)
+{
+    return u32to8(s.data(), s.size(), throw_on_inv_chars);
+}
+inline std::u32string u16to32(std::u16string_view s, bool throw_on_inv_chars = u8_default_throw)
+{
+    return u16to32(s.data(), s.size(), throw_on_inv_chars);
+}
+inline std::u16string u32to16(std::u32string_view s, bool throw_on_inv_chars = u8_default_throw)
+{
+    return u32to16(s.data(), s.size(), throw_on_inv_chars);
+}
+#endif
+
+#ifdef __cpp_lib_char8_t
+inline std::u32string u8to32(std::u8string_view s, bool throw_on_inv_chars = u8_default_throw)
+{
+    return u8to32(reinterpret_cast<const char*>(s.data()), s.size(), throw_on_inv_chars);
+}
+#endif
+
+// Like u8to16_into and u16to8_into. A buffer of len code points always suffices for u8to32_into
+// and u16to32_into, one of 4 * len bytes for u32to8_into and one of 2 * len code units for
+// u32to16_into.
+
+u8_conversion_result u8to32_into(const char* s, size_t len, std::u32string& out, bool replace_inv_chars = !u8_default_throw);
+
+u8_conversion_result u32to8_into(const char32_t* s, size_t len, std::string& out, bool replace_inv_chars = !u8_default_throw);
+
+u8_conversion_result u16to32_into(const char16_t* s, size_t len, std::u32string& out, bool replace_inv_chars = !u8_default_throw);
+
+u8_conversion_result u32to16_into(const char32_t* s, size_t len, std::u16string& out, bool replace_inv_chars = !u8_default_throw);
+
+#ifdef __cpp_lib_string_view
+inline u8_conversion_result u8to32_into(std::string_view s, std::u32string& out, bool replace_inv_chars = !u8_default_throw)
+{
+    return u8to32_into(s.data(), s.size(), out, replace_inv_chars);
+}
+inline u8_conversion_result u32to8_into(std::u32string_view s, std::string& out, bool replace_inv_chars = !u8_default_throw)
+{
+    return u32to8_into(s.data(), s.size(), out, replace_inv_chars);
+}
+inline u8_conversion_result u16to32_into(std::u16string_view s, std::u32string& out, bool replace_inv_chars = !u8_default_throw)
+{
+    return u16to32_into(s.data(), s.size(), out, replace_inv_chars);
+}
+inline u8_conversion_result u32to16_into(std::u32string_view s, std::u16string& out, bool replace_inv_chars = !u8_default_throw)
+{
+    return u32to16_into(s.data(), s.size(), out, replace_inv_chars);
+}
+#else
+inline u8_conversion_result u8to32_into(const std::string& s, std::u32string& out, bool replace_inv_chars = !u8_default_throw)
+{
+    return u8to32_into(s.data(), s.size(), out, replace_inv_chars);
+}
+inline u8_conversion_result u32to8_into(const std::u32string& s, std::string& out, bool replace_inv_chars = !u8_default_throw)
+{
+    return u32to8_into(s.data(), s.size(), out, replace_inv_chars);
+}
+inline u8_conversion_result u16to32_into(const std::u16string& s, std::u32string& out, bool replace_inv_chars = !u8_default_throw)
+{
+    return u16to32_into(s.data(), s.size(), out, replace_inv_chars);
+}
+inline u8_conversion_result u32to16_into(const std::u32string& s, std::u16string& out, bool replace_inv_chars = !u8_default_throw)
+{
+    return u32to16_into(s.data(), s.size(), out, replace_inv_chars);
+}
+#endif
+
+u8_conversion_result u8to32_into(const char* s, size_t len, char32_t* out, size_t out_capacity, bool replace_inv_chars = !u8_default_throw);
+
+u8_conversion_result u32to8_into(const char32_t* s, size_t len, char* out, size_t out_capacity, bool replace_inv_chars = !u8_default_throw);
+
+u8_conversion_result u16to32_into(const char16_t* s, size_t len, char32_t* out, size_t out_capacity, bool replace_inv_chars = !u8_default_throw);
+
+u8_conversion_result u32to16_into(const char32_t* s, size_t len, char16_t* out, size_t out_capacity, bool replace_inv_chars = !u8_default_throw);
+
+// Converts utf-8 that arrives in chunks, e.g. from a socket or file, to utf-16. A code point that is
+// split between two chunks is carried over to the next call (at most 3 bytes), so chunks may end
+// anywhere. Invalid sequences are replaced by U+FFFD if replace_inv_chars is true. Otherwise decode
+// stops at them like u8to16_into; error_offset is 0 if the sequence started in an earlier chunk.
+class U8StreamDecoder
+{
+public:
+    U8StreamDecoder(bool replace_inv_chars = !u8_default_throw)
+        : m_replace_inv_chars(replace_inv_chars), m_carry_size(0) {}
+
+    // out must have room for len + 1 code units.
+    u8_conversion_result decode(const char* s, size_t len, char16_t* out);
+    // appends to out
+    u8_conversion_result decode(const char* s, size_t len, std::u16string& out);
+    // Call at the end of the input. A carried incomplete sequence is invalid then.
+    // out must have room for 1 code unit.
+    u8_conversion_result finish(char16_t* out);
+
+    // number of bytes carried over to the next chunk
+    size_t pending() const { return m_carry_size; }
+    void reset() { m_carry_size = 0; }
+private:
+    bool m_replace_inv_chars;
+    unsigned char m_carry[3];
+    size_t m_carry_size;
+};
+
+// The counterpart of U8StreamDecoder: converts utf-16 that arrives in chunks to utf-8. A high
+// surrogate at the end of a chunk is kept until the next chunk supplies the low surrogate.
+class U8StreamEncoder
+{
+public:
+    U8StreamEncoder(bool replace_inv_chars = !u8_default_throw)
+        : m_replace_inv_chars(replace_inv_chars), m_high_surrogate(0) {}
+
+    // out must have room for 3 * len + 3 bytes.
+    u8_conversion_result encode(const char16_t* s, size_t len, char* out);
+    // appends to out
+    u8_conversion_result encode(const char16_t* s, size_t len, std::string& out);
+    // Call at the end of the input. A kept high surrogate is invalid then.
+    // out must have room for 3 bytes.
+    u8_conversion_result finish(char* out);
+
+    // number of code units carried over to the next chunk
+    size_t pending() const { return m_high_surrogate ? 1 : 0; }
+    void reset() { m_high_surrogate = 0; }
+private:
+    bool m_replace_inv_chars;
+    char16_t m_high_surrogate;
+};
+
+// Returns true if s is well-formed utf-8. Otherwise, if error_offset is not null, the byte offset
+// of the first invalid sequence is stored in *error_offset. Does not allocate memory.
+bool u8validate(const char* s, size_t len, size_t* error_offset = nullptr);
+
+inline bool u8validate(const std::string& s, size_t* error_offset = nullptr)
+{
+    return u8validate(s.data(), s.size(), error_offset);
+}
+
+// Counters of the conversions, the exceptions and the console i/o, kept per thread and summed by
+// u8_get_stats. They are only counted if libpu8.cpp is compiled with LIBPU8_INSTRUMENT defined
+// to 1; otherwise nothing is counted and the counters returned by u8_get_stats are zero. u8widen and u8narrow are only counted if they use the
+// portable conversion.
+#ifndef LIBPU8_INSTRUMENT
+#define LIBPU8_INSTRUMENT 0
+#endif
+
+struct u8_call_stats
+{
+    unsigned long long calls;
+    // code units read and written (bytes for utf-8)
+    unsigned long long input;
+    unsigned long long output;
+    // calls that stopped at invalid input
+    unsigned long long errors;
+    unsigned long long nanoseconds;
+};
+
+enum class u8_kernel_tier { scalar, sse2, ssse3, avx2, avx512 };
+
+struct u8_stats
+{
+    // all utf-8 to utf-16 conversions, including U8StreamDecoder and U8NativePath on windows
+    u8_call_stats to16;
+    // all utf-16 to utf-8 conversions, including U8StreamEncoder
+    u8_call_stats to8;
+    u8_call_stats validate;
+    // utf-8 or utf-16 to utf-32, and utf-32 to utf-8 or utf-16
+    u8_call_stats to32;
+    u8_call_stats from32;
+    // U8ConversionError thrown by the library
+    unsigned long long exceptions;
+    // writes to the sink of a U8ConsoleOstreamBuf (e.g. WriteConsoleW calls) and reads from the
+    // source of a U8ConsoleIstreamBuf
+    unsigned long long sink_writes;
+    unsigned long long source_reads;
+    // the kernels selected for this cpu
+    u8_kernel_tier to16_tier;
+    u8_kernel_tier to8_tier;
+    u8_kernel_tier validate_tier;
+    u8_kernel_tier to32_tier;
+    u8_kernel_tier from32_tier;
+};
+
+// Sums the counters of all threads, including threads that have finished, since the last reset.
+u8_stats u8_get_stats();
+void u8_reset_stats();
+
+enum class u8_stats_event { exception, sink_write, source_read };
+
+// counts an event of the templates below. They call it whatever LIBPU8_INSTRUMENT is where they
+// are instantiated, so that every translation unit sees the same definitions; it does nothing
+// unless libpu8.cpp is instrumented.
+void u8_count_event(u8_stats_event event);
+
+// Stream buffers that convert between utf-8 and a utf-16 sink or source. On windows, they replace
+// the buffers of cout, cerr and cin with the console as sink and source.
+// Sink must provide bool write(const char16_t* s, size_t len).
+// Source must provide bool read(char16_t* buffer, size_t capacity, size_t& read); false or
+// read == 0 mean the end of the input.
+
+template <class Sink>
+class U8ConsoleOstreamBuf : public std::streambuf
+{
+public:
+    explicit U8ConsoleOstreamBuf(Sink sink) : m_sink(sink)
+    {
+        setp(m_buffer, m_buffer + buffer_size);
+    }
+
+    // writes what is still buffered, like std::basic_filebuf. Errors are ignored here; call
+    // sync() (or flush the stream) first to see them.
+    ~U8ConsoleOstreamBuf()
+    {
+        try
+        {
+            sync();
+        }
+        catch (...)
+        {
+        }
+    }
+
+    int sync()override;
+    Sink& sink() { return m_sink; }
+private:
+    int_type overflow(int_type c) override;
+    std::streamsize xsputn(const char* s, std::streamsize n) override;
+    // converts the put area, writes it to the sink and empties it
+    bool flush_buffer();
+    // converts s (at most buffer_size bytes) and writes it to the sink
+    bool write_converted(const char* s, size_t len);
+
+    static const size_t buffer_size = 4096;
+    char m_buffer[buffer_size];
+    // the decoder may write one code unit more than it reads
+    char16_t m_wide_buffer[buffer_size + 1];
+    // keeps code points that are split between two flushes
+    U8StreamDecoder m_decoder;
+    Sink m_sink;
+};
+
+template <class Source>
+class U8ConsoleIstreamBuf : public std::streambuf
+{
+public:
+    static const size_t default_read_size = 4096;
+
+    // read_size is the maximum number of utf-16 code units read from the source at once.
+    // The buffers are allocated once, here.
+    explicit U8ConsoleIstreamBuf(Source source, size_t read_size = default_read_size)
+        : m_read_size(read_size ? read_size : 1), m_wide_buffer(m_read_size, u'\0'),
+          m_buffer(3 * m_read_size + 3, '\0'), m_source(source)
+    {
+        setg(0, 0, 0);
+    }
+
+    Source& source() { return m_source; }
+private:
+    int_type underflow() override;
+    std::streamsize xsgetn(char* s, std::streamsize n) override;
+    // reads from the source and converts into out, which must have room for 3 * m_read_size + 3
+    // bytes. Returns false at the end of the input. Throws a U8ConversionError on an unpaired
+    // surrogate, also at the end of the input.
+    bool read_converted(char* out, size_t& written);
+
+    size_t m_read_size;
+    std::u16string m_wide_buffer;
+    // keeps a high surrogate that ends a read until the next one
+    U8StreamEncoder m_encoder;
+    std::string m_buffer;
+    Source m_source;
+};
+
+template <class Sink>
+bool U8ConsoleOstreamBuf<Sink>::write_converted(const char* s, size_t len)
+{
+    u8_conversion_result result = m_decoder.decode(s, len, m_wide_buffer);
+    if (result.output_written)
+    {
+        u8_count_event(u8_stats_event::sink_write);
+        if (!m_sink.write(m_wide_buffer, result.output_written))
+            return false;
+    }
+    if (result.status != u8_conversion_status::ok)
+    {
+        m_decoder.reset();
+        u8_count_event(u8_stats_event::exception);
+        throw U8ConversionError("utf8 to utf16 conversion failed: invalid utf8 sequence at byte offset "
+            + std::to_string(result.error_offset) + ".");
+    }
+    return true;
+}
+
+template <class Sink>
+bool U8ConsoleOstreamBuf<Sink>::flush_buffer()
+{
+    size_t len = size_t(pptr() - pbase());
+    setp(m_buffer, m_buffer + buffer_size);
+    return write_converted(m_buffer, len);
+}
+
+template <class Sink>
+int U8ConsoleOstreamBuf<Sink>::sync()
+{
+    return flush_buffer() ? 0 : -1;
+}
+
+template <class Sink>
+typename U8ConsoleOstreamBuf<Sink>::int_type U8ConsoleOstreamBuf<Sink>::overflow(int_type c)
+{
+    if (!flush_buffer())
+        return traits_type::eof();
+    if (!traits_type::eq_int_type(c, traits_type::eof()))
+    {
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+    }
+    return traits_type::not_eof(c);
+}
+
+template <class Sink>
+std::streamsize U8ConsoleOstreamBuf<Sink>::xsputn(const char* s, std::streamsize n)
+{
+    size_t len = size_t(n);
+    if (len > size_t(epptr() - pptr()))
+    {
+        if (!flush_buffer())
+            return 0;
+        if (len >= buffer_size)
+        {
+            // bypass the put area
+            for (size_t done = 0; done < len; done += buffer_size)
+            {
+                if (!write_converted(s + done, len - done < buffer_size ? len - done : buffer_size))
+                    return std::streamsize(done);
+            }
+            return n;
+        }
+    }
+    std::memcpy(pptr(), s, len);
+    pbump(int(len));
+    return n;
+}
+
+template <class Source>
+bool U8ConsoleIstreamBuf<Source>::read_converted(char* out, size_t& written)
+{
+    size_t read_size = 0;
+    u8_count_event(u8_stats_event::source_read);
+    bool end = !m_source.read(&m_wide_buffer[0], m_read_size, read_size) || read_size == 0;
+    // at the end, a kept high surrogate is unpaired
+    u8_conversion_result result = end ? m_encoder.finish(out)
+        : m_encoder.encode(m_wide_buffer.data(), read_size, out);
+    if (result.status != u8_conversion_status::ok)
+    {
+        m_encoder.reset();
+        u8_count_event(u8_stats_event::exception);
+        throw U8ConversionError("utf16 to utf8 conversion failed: unpaired surrogate at code unit offset "
+            + std::to_string(result.error_offset) + ".");
+    }
+    written = result.output_written;
+    return !end || written;
+}
+
+template <class Source>
+typename U8ConsoleIstreamBuf<Source>::int_type U8ConsoleIstreamBuf<Source>::underflow()
+{
+    // a read that only returns a high surrogate produces no output yet
+    while (gptr() >= egptr())
+    {
+        size_t written;
+        if (!read_converted(&m_buffer[0], written))
+            return traits_type::eof();
+        setg(&m_buffer[0], &m_buffer[0], &m_buffer[0] + written);
+    }
+
+    return sgetc();
+}
+
+template <class Source>
+std::streamsize U8ConsoleIstreamBuf<Source>::xsgetn(char* s, std::streamsize n)
+{
+    size_t len = size_t(n);
+    size_t done = 0;
+    while (done < len)
+    {
+        size_t available = size_t(egptr() - gptr());
+        if (available)
+        {
+            size_t k = available < len - done ? available : len - done;
+            std::memcpy(s + done, gptr(), k);
+            gbump(int(k));
+            done += k;
+        }
+        else if (len - done >= 3 * m_read_size + 3)
+        {
+            // enough room to convert straight into s
+            size_t written;
+            if (!read_converted(s + done, written))
+                break;
+            done += written;
+        }
+        else if (traits_type::eq_int_type(underflow(), traits_type::eof()))
+            break;
+    }
+    return std::streamsize(done);
+}
+
+// In-memory utf-16 sink and source, e.g. for tests and benchmarks of the stream buffers.
+
+// appends to a std::u16string, which must outlive the sink
+class U8MemorySink
+{
+public:
+    U8MemorySink(std::u16string& out) : m_out(&out) {}
+    bool write(const char16_t* s, size_t len)
+    {
+        m_out->append(s, len);
+        return true;
+    }
+private:
+    std::u16string* m_out;
+};
+
+// reads [s, s + len), which must outlive the source
+class U8MemorySource
+{
+public:
+    U8MemorySource(const char16_t* s, size_t len) : m_pos(s), m_end(s + len) {}
+    bool read(char16_t* buffer, size_t capacity, size_t& read)
+    {
+        read = size_t(m_end - m_pos) < capacity ? size_t(m_end - m_pos) : capacity;
+        // m_pos may be null for an empty source, which memcpy does not allow even for 0 bytes
+        if (read)
+            std::memcpy(buffer, m_pos, read * sizeof(char16_t));
+        m_pos += read;
+        return true;
+    }
+private:
+    const char16_t* m_pos;
+    const char16_t* m_end;
+};
+
 #ifdef _WIN32
 
+// u8widen and u8narrow call the win32 functions by default; define this to 0 for the portable conversion
+#ifndef LIBPU8_USE_WIN32_CONVERSION
+#define LIBPU8_USE_WIN32_CONVERSION 1
+#endif
+
 #define WIN32_LEAN_AND_MEAN
 #define NOMINMAX
 #include <windows.h>
-#include <streambuf>
 #include <cassert>
 #include <cwchar>
-#include <cstring>
-
-static const bool u8_default_throw = true;
+#include <memory>
 
 std::wstring u8widen(const char* s, size_t len, bool throw_on_inv_chars = u8_default_throw);
 
 // u8widen and u8narrow throw a U8ConversionError if conversion failed and if throw_on_inv_chars is true.
-// If throw_on_inv_chars is false, then invalid characters are silently replaced by a replacement character
+// If throw_on_inv_chars is false, then invalid characters are replaced by U+FFFD like in u8to16 and
+// u16to8, also if LIBPU8_USE_WIN32_CONVERSION is 1.
 
 inline std::wstring u8widen(const std::string& s, bool throw_on_inv_chars = u8_default_throw)
 {
@@ -104,42 +755,143 @@ inline std::string u8narrow(const std::wstring& s, bool throw_on_inv_chars = u8_
     return u8narrow(s.data(), s.size(), throw_on_inv_chars);
 }
 
+#ifdef __cpp_lib_string_view
+inline std::wstring u8widen(std::string_view s, bool throw_on_inv_chars = u8_default_throw)
+{
+    return u8widen(s.data(), s.size(), throw_on_inv_chars);
+}
+inline std::string u8narrow(std::wstring_view s, bool throw_on_inv_chars = u8_default_throw)
+{
+    return u8narrow(s.data(), s.size(), throw_on_inv_chars);
+}
+#endif
+
+#ifdef __cpp_lib_char8_t
+inline std::wstring u8widen(std::u8string_view s, bool throw_on_inv_chars = u8_default_throw)
+{
+    return u8widen(reinterpret_cast<const char*>(s.data()), s.size(), throw_on_inv_chars);
+}
+#endif
+
+// Exception-free variants, see u8to16_into. They always use the portable conversion.
+
+u8_conversion_result u8widen_into(const char* s, size_t len, std::wstring& out, bool replace_inv_chars = !u8_default_throw);
+
+u8_conversion_result u8narrow_into(const wchar_t *s, size_t len, std::string& out, bool replace_inv_chars = !u8_default_throw);
+
+#ifdef __cpp_lib_string_view
+inline u8_conversion_result u8widen_into(std::string_view s, std::wstring& out, bool replace_inv_chars = !u8_default_throw)
+{
+    return u8widen_into(s.data(), s.size(), out, replace_inv_chars);
+}
+inline u8_conversion_result u8narrow_into(std::wstring_view s, std::string& out, bool replace_inv_chars = !u8_default_throw)
+{
+    return u8narrow_into(s.data(), s.size(), out, replace_inv_chars);
+}
+#else
+inline u8_conversion_result u8widen_into(const std::string& s, std::wstring& out, bool replace_inv_chars = !u8_default_throw)
+{
+    return u8widen_into(s.data(), s.size(), out, replace_inv_chars);
+}
+inline u8_conversion_result u8narrow_into(const std::wstring& s, std::string& out, bool replace_inv_chars = !u8_default_throw)
+{
+    return u8narrow_into(s.data(), s.size(), out, replace_inv_chars);
+}
+#endif
+
+size_t u8widen_length(const char* s, size_t len);
+
+inline size_t u8widen_length(const std::string& s)
+{
+    return u8widen_length(s.data(), s.size());
+}
+
+size_t u8narrow_length(const wchar_t *s, size_t len);
+
+inline size_t u8narrow_length(const std::wstring& s)
+{
+    return u8narrow_length(s.data(), s.size());
+}
+
+u8_conversion_result u8widen_into(const char* s, size_t len, wchar_t* out, size_t out_capacity, bool replace_inv_chars = !u8_default_throw);
+
+u8_conversion_result u8narrow_into(const wchar_t *s, size_t len, char* out, size_t out_capacity, bool replace_inv_chars = !u8_default_throw);
+
+u8_conversion_result u8widen_append(const char* s, size_t len, std::wstring& out, bool replace_inv_chars = !u8_default_throw);
+
+inline u8_conversion_result u8widen_append(const std::string& s, std::wstring& out, bool replace_inv_chars = !u8_default_throw)
+{
+    return u8widen_append(s.data(), s.size(), out, replace_inv_chars);
+}
+
+u8_conversion_result u8narrow_append(const wchar_t *s, size_t len, std::string& out, bool replace_inv_chars = !u8_default_throw);
 
-class U8ConsoleOstreamBufWin32 : public std::stringbuf
+inline u8_conversion_result u8narrow_append(const std::wstring& s, std::string& out, bool replace_inv_chars = !u8_default_throw)
+{
+    return u8narrow_append(s.data(), s.size(), out, replace_inv_chars);
+}
+
+// Returned by u8widen_view. Converts to a null-terminated native string, so it can be passed
+// directly to fstream constructors or to windows API functions. On windows it owns the converted
+// string; elsewhere it only refers to the utf-8 argument, which must outlive it. A temporary
+// std::string argument does not compile, on windows too.
+class U8PathArg
 {
 public:
-    U8ConsoleOstreamBufWin32(DWORD handleId) : m_handle(::GetStdHandle(handleId)) {}
+    U8PathArg(const char* s, size_t len, bool throw_on_inv_chars)
+        : m_str(u8widen(s, len, throw_on_inv_chars)) {}
 
-    int sync()override;
+    const wchar_t* c_str() const { return m_str.c_str(); }
+    size_t size() const { return m_str.size(); }
+    operator const wchar_t*() const { return m_str.c_str(); }
 private:
-    static bool is_utf8_continuation(unsigned char c)
-    {
-        return ((c & 192) == 128);
-    }
-    static bool is_utf8_leading(unsigned char c)
+    std::wstring m_str;
+};
+
+inline U8PathArg u8widen_view(const std::string& s, bool throw_on_inv_chars = u8_default_throw)
+{
+    return U8PathArg(s.data(), s.size(), throw_on_inv_chars);
+}
+inline U8PathArg u8widen_view(const char* s, bool throw_on_inv_chars = u8_default_throw)
+{
+    return U8PathArg(s, std::strlen(s), throw_on_inv_chars);
+}
+// deleted, so that code that compiles here does not keep a pointer into a temporary elsewhere
+U8PathArg u8widen_view(std::string&& s, bool throw_on_inv_chars = u8_default_throw) = delete;
+
+
+class U8Win32ConsoleSink
+{
+public:
+    U8Win32ConsoleSink(DWORD handleId) : m_handle(::GetStdHandle(handleId)) {}
+    bool write(const char16_t* s, size_t len)
     {
-        return ((c & 192) == 192);
+        DWORD writtenSize;
+        return ::WriteConsoleW(m_handle, s, DWORD(len), &writtenSize, NULL) != 0;
     }
-
-    // may return more bytes than necessary
-    static size_t num_trailing_partial_bytes(const std::string& s);
-    std::string m_unwritten_partial_bytes;
+private:
     HANDLE m_handle;
 };
 
-class U8ConsoleIstreamBufWin32 : public std::streambuf
+class U8Win32ConsoleSource
 {
 public:
-    U8ConsoleIstreamBufWin32(DWORD handleId) : m_handle(::GetStdHandle(handleId)) 
+    U8Win32ConsoleSource(DWORD handleId) : m_handle(::GetStdHandle(handleId)) {}
+    bool read(char16_t* buffer, size_t capacity, size_t& read)
     {
-        setg(0, 0, 0);
+        DWORD readSize;
+        if (!::ReadConsoleW(m_handle, buffer, DWORD(capacity), &readSize, NULL))
+            return false;
+        read = readSize;
+        return true;
     }
 private:
-    int_type underflow() override;
-    std::string m_buffer;
     HANDLE m_handle;
 };
 
+typedef U8ConsoleOstreamBuf<U8Win32ConsoleSink> U8ConsoleOstreamBufWin32;
+typedef U8ConsoleIstreamBuf<U8Win32ConsoleSource> U8ConsoleIstreamBufWin32;
+
 
 class U8StdInStreamFixer
 {
@@ -262,6 +1014,138 @@ inline std::string u8widen(const std::string& s, bool = true)
 { return s; }
 inline std::string u8widen(const char* s, bool = true)
 { return std::string(s); }
+#ifdef __cpp_lib_string_view
+inline std::string u8widen(std::string_view s, bool = true)
+{ return std::string(s); }
+#endif
+#ifdef __cpp_lib_char8_t
+inline std::string u8widen(std::u8string_view s, bool = true)
+{ return std::string(reinterpret_cast<const char*>(s.data()), s.size()); }
+#endif
+
+// like u8widen, u8widen_into copies s unchanged
+inline u8_conversion_result u8widen_into(const char* s, size_t len, std::string& out, bool = false)
+{
+    out.assign(s, len);
+    u8_conversion_result result = { u8_conversion_status::ok, len, len, len };
+    return result;
+}
+#ifdef __cpp_lib_string_view
+inline u8_conversion_result u8widen_into(std::string_view s, std::string& out, bool = false)
+{
+    return u8widen_into(s.data(), s.size(), out);
+}
+#else
+inline u8_conversion_result u8widen_into(const std::string& s, std::string& out, bool = false)
+{
+    return u8widen_into(s.data(), s.size(), out);
+}
+#endif
+inline u8_conversion_result u8widen_into(const char* s, size_t len, char* out, size_t out_capacity, bool = false)
+{
+    size_t n = len;
+    u8_conversion_status status = u8_conversion_status::ok;
+    if (len > out_capacity)
+    {
+        // do not split a code point
+        n = out_capacity;
+        while (n > 0 && n + 3 > out_capacity && (static_cast<unsigned char>(s[n]) & 0xC0) == 0x80)
+            --n;
+        status = u8_conversion_status::output_too_small;
+    }
+    std::memcpy(out, s, n);
+    u8_conversion_result result = { status, n, n, n };
+    return result;
+}
+inline u8_conversion_result u8widen_append(const char* s, size_t len, std::string& out, bool = false)
+{
+    out.append(s, len);
+    u8_conversion_result result = { u8_conversion_status::ok, len, len, len };
+    return result;
+}
+inline u8_conversion_result u8widen_append(const std::string& s, std::string& out, bool = false)
+{
+    return u8widen_append(s.data(), s.size(), out);
+}
+inline size_t u8widen_length(const char*, size_t len)
+{ return len; }
+inline size_t u8widen_length(const std::string& s)
+{ return s.size(); }
+
+// see the windows version. u8widen_view neither converts nor copies here.
+class U8PathArg
+{
+public:
+    U8PathArg(const char* s, size_t len) : m_str(s), m_len(len) {}
+
+    const char* c_str() const { return m_str; }
+    size_t size() const { return m_len; }
+    operator const char*() const { return m_str; }
+private:
+    const char* m_str;
+    size_t m_len;
+};
+
+inline U8PathArg u8widen_view(const std::string& s, bool = true)
+{ return U8PathArg(s.c_str(), s.size()); }
+inline U8PathArg u8widen_view(const char* s, bool = true)
+{ return U8PathArg(s, std::strlen(s)); }
+// the result would point into the temporary string, which is gone at the end of the statement
+U8PathArg u8widen_view(std::string&& s, bool = true) = delete;
+
+#endif
+
+#ifdef _WIN32
+typedef wchar_t u8_native_char;
+#else
+typedef char u8_native_char;
+#endif
+
+// A utf-8 path converted to the native encoding: utf-16 on windows, unchanged elsewhere. Like
+// U8PathArg, it converts implicitly to a null-terminated native string for fstream, and also to
+// std::filesystem::path. Unlike U8PathArg, it owns a copy. Paths shorter than MAX_PATH are
+// stored inline, so they are converted without allocating memory.
+class U8NativePath
+{
+public:
+    static const size_t inline_capacity = 260;
+
+    U8NativePath(const char* s, size_t len, bool throw_on_inv_chars = u8_default_throw);
+    U8NativePath(const char* s, bool throw_on_inv_chars = u8_default_throw)
+        : U8NativePath(s, std::strlen(s), throw_on_inv_chars) {}
+    U8NativePath(const std::string& s, bool throw_on_inv_chars = u8_default_throw)
+        : U8NativePath(s.data(), s.size(), throw_on_inv_chars) {}
+#ifdef __cpp_lib_string_view
+    U8NativePath(std::string_view s, bool throw_on_inv_chars = u8_default_throw)
+        : U8NativePath(s.data(), s.size(), throw_on_inv_chars) {}
+#endif
+
+    // m_heap is only used for paths that do not fit into m_buffer, so it is never empty then
+    const u8_native_char* c_str() const { return m_heap.empty() ? m_buffer : m_heap.c_str(); }
+    size_t size() const { return m_size; }
+    operator const u8_native_char*() const { return c_str(); }
+#ifdef __cpp_lib_filesystem
+    operator std::filesystem::path() const { return std::filesystem::path(c_str(), c_str() + m_size); }
+#endif
+private:
+    u8_native_char m_buffer[inline_capacity];
+    std::basic_string<u8_native_char> m_heap;
+    size_t m_size;
+};
+
+#ifndef _WIN32
+
+inline U8NativePath::U8NativePath(const char* s, size_t len, bool)
+    : m_size(len)
+{
+    if (len < inline_capacity)
+    {
+        std::memcpy(m_buffer, s, len);
+        m_buffer[len] = 0;
+    }
+    else
+        m_heap.assign(s, len);
+}
 
 
 #endif
@@ -0,0 +1,84 @@
+/*
+Checks the conversions against a simple scalar reference implementation. This file has main and
+the throwing conversions of random input; the other areas have a file each, see test_util.h.
+
+The simd kernels are selected once per process. ctest runs this program once per tier with
+LIBPU8_MAX_SIMD set to none, sse2, ssse3, avx2 and avx512.
+
+Usage: libpu8_test [iterations [seed]]
+*/
+
+#include "test_util.h"
+
+#include <cstdlib>
+
+int failures = 0;
+const char* current_test = "";
+std::string current_input;
+std::mt19937 rng;
+
+// The throwing conversions return the whole string or throw at the first invalid sequence.
+template <class In, class Out, class Convert>
+static void check_throwing(const In& s, const Out& expected, bool valid, Convert convert)
+{
+    bool threw = false;
+    try
+    {
+        CHECK(convert(s) == expected);
+    }
+    catch (const U8ConversionError&)
+    {
+        threw = true;
+    }
+    CHECK(threw == !valid);
+}
+
+void test_conversions(int iterations)
+{
+    current_test = "random utf-8";
+    for (int i = 0; i < iterations; ++i)
+    {
+        std::string s = random_utf8();
+        set_input(s);
+        size_t error, consumed;
+        std::u32string strict = ref_decode_utf8(s, false, error, consumed);
+        check_throwing(s, to_utf16(strict), error == npos, [](const std::string& in) { return u8to16(in); });
+    }
+    current_test = "random utf-16";
+    for (int i = 0; i < iterations; ++i)
+    {
+        std::u16string s = random_utf16();
+        set_input(s);
+        size_t error;
+        std::u32string strict = ref_decode_utf16(s, false, error);
+        check_throwing(s, to_utf8(strict), error == npos, [](const std::u16string& in) { return u16to8(in); });
+    }
+}
+
+int main(int argc, char** argv)
+{
+    int iterations = argc > 1 ? std::atoi(argv[1]) : 2000;
+    rng.seed(argc > 2 ? unsigned(std::strtoul(argv[2], 0, 10)) : 1);
+    const char* tier = std::getenv("LIBPU8_MAX_SIMD");
+    std::printf("LIBPU8_MAX_SIMD=%s\n", tier ? tier : "");
+
+    test_conversions(iterations);
+    test_validate(iterations);
+    test_into(iterations);
+    test_length(iterations);
+    test_view(iterations);
+    test_stream(iterations);
+    test_console(iterations);
+    test_lossy(iterations);
+    test_utf32(iterations);
+
+#if LIBPU8_INSTRUMENT
+    static const char* const tiers[] = {"scalar", "sse2", "ssse3", "avx2", "avx512"};
+    u8_stats stats = u8_get_stats();
+    std::printf("kernels: to16 %s, to8 %s, validate %s, to32 %s, from32 %s\n", tiers[int(stats.to16_tier)],
+        tiers[int(stats.to8_tier)], tiers[int(stats.validate_tier)], tiers[int(stats.to32_tier)],
+        tiers[int(stats.from32_tier)]);
+#endif
+    std::printf("%d failures\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,162 @@
+/*
+The console stream buffers over an in-memory sink and source.
+*/
+
+#include "test_util.h"
+
+#include <istream>
+#include <ostream>
+
+static std::string random_valid_utf8()
+{
+    size_t error;
+    return to_utf8(ref_check_utf32(random_utf32(), true, error));
+}
+
+// a sink whose writes fail, like a closed console handle
+class FailingSink
+{
+public:
+    bool write(const char16_t*, size_t) { return false; }
+};
+
+// writes s in pieces of at most max_piece bytes
+static std::u16string write_in_pieces(const std::string& s, size_t max_piece)
+{
+    std::u16string sink_out;
+    {
+        U8ConsoleOstreamBuf<U8MemorySink> out_buf((U8MemorySink(sink_out)));
+        std::ostream out(&out_buf);
+        for (size_t pos = 0; pos < s.size();)
+        {
+            size_t n = rng() % (max_piece + 1);
+            n = n < s.size() - pos ? n : s.size() - pos;
+            if (n == 1)
+                out.put(s[pos]);
+            else
+                out.write(s.data() + pos, std::streamsize(n));
+            pos += n;
+        }
+        out.flush();
+        CHECK(out.good());
+    }
+    return sink_out;
+}
+
+void test_console(int iterations)
+{
+    current_test = "console output";
+    for (int i = 0; i < iterations / 40; ++i)
+    {
+        // small pieces go through the put area, code points are split between flushes
+        std::string s = random_valid_utf8();
+        set_input(s);
+        CHECK(write_in_pieces(s, 6) == u8to16(s));
+        // large pieces bypass the put area
+        s += random_valid_utf8() + random_valid_utf8();
+        set_input(s);
+        CHECK(write_in_pieces(s, 10000) == u8to16(s));
+    }
+
+    current_test = "console input";
+    for (int i = 0; i < iterations / 40; ++i)
+    {
+        std::string s = random_valid_utf8();
+        std::u16string wide = u8to16(s);
+        set_input(s);
+        // a small read size splits surrogate pairs between reads
+        U8ConsoleIstreamBuf<U8MemorySource> in_buf(U8MemorySource(wide.data(), wide.size()), 1 + rng() % 8);
+        std::istream in(&in_buf);
+        std::string read;
+        char c;
+        while (in.get(c))
+            read += c;
+        CHECK(read == s);
+        CHECK(!in.bad());
+    }
+
+    // an unpaired surrogate is an error, also at the end of the input
+    static const char16_t* const invalid[] = {u"ab\xD83D" u"cd", u"ab\xDE00", u"ab\xD83D", u"\xD83D"};
+    for (const char16_t* s : invalid)
+    {
+        std::u16string wide(s);
+        set_input(wide);
+        for (size_t read_size = 1; read_size < 5; ++read_size)
+        {
+            U8ConsoleIstreamBuf<U8MemorySource> in_buf(U8MemorySource(wide.data(), wide.size()), read_size);
+            std::istream in(&in_buf);
+            std::string read;
+            std::getline(in, read);
+            CHECK(in.bad());
+
+            U8ConsoleIstreamBuf<U8MemorySource> raw_buf(U8MemorySource(wide.data(), wide.size()), read_size);
+            char buffer[64];
+            bool threw = false;
+            try
+            {
+                raw_buf.sgetn(buffer, sizeof(buffer));
+            }
+            catch (const U8ConversionError&)
+            {
+                threw = true;
+            }
+            CHECK(threw);
+        }
+    }
+
+    current_test = "console bulk input";
+    for (int i = 0; i < iterations / 40; ++i)
+    {
+        std::string s = random_valid_utf8() + random_valid_utf8();
+        std::u16string wide = u8to16(s);
+        set_input(s);
+        // pieces larger than 3 * read_size + 3 bytes are converted straight into the destination
+        size_t read_size = 1 + rng() % 600;
+        U8ConsoleIstreamBuf<U8MemorySource> in_buf(U8MemorySource(wide.data(), wide.size()), read_size);
+        std::string read;
+        std::vector<char> piece(4 * read_size + 8);
+        for (;;)
+        {
+            std::streamsize n = in_buf.sgetn(piece.data(), std::streamsize(1 + rng() % piece.size()));
+            if (n == 0)
+                break;
+            read.append(piece.data(), size_t(n));
+        }
+        CHECK(read == s);
+    }
+
+    // the destructor writes what is still buffered
+    std::u16string sink_out;
+    {
+        U8ConsoleOstreamBuf<U8MemorySink> out_buf((U8MemorySink(sink_out)));
+        std::ostream out(&out_buf);
+        out << "d\xC3\xA9j\xC3\xA0 vu";
+        CHECK(sink_out.empty());
+    }
+    CHECK(sink_out == u"d\xE9j\xE0 vu");
+    {
+        U8ConsoleOstreamBuf<U8MemorySink> out_buf((U8MemorySink(sink_out)));
+        std::ostream out(&out_buf);
+        out << "invalid \xFF";
+    }
+    CHECK(sink_out == u"d\xE9j\xE0 vuinvalid ");
+
+    // a failing sink makes the stream bad
+    {
+        U8ConsoleOstreamBuf<FailingSink> out_buf((FailingSink()));
+        std::ostream out(&out_buf);
+        out << "text";
+        CHECK(out.good());
+        out.flush();
+        CHECK(out.bad());
+    }
+
+    // an empty source, also without a buffer
+    U8ConsoleIstreamBuf<U8MemorySource> empty_buf(U8MemorySource(nullptr, 0));
+    std::istream empty(&empty_buf);
+    CHECK(empty.get() == std::char_traits<char>::eof());
+    CHECK(empty.eof() && !empty.bad());
+    char buffer[64];
+    U8ConsoleIstreamBuf<U8MemorySource> empty_raw_buf(U8MemorySource(nullptr, 0), 1);
+    CHECK(empty_raw_buf.sgetn(buffer, sizeof(buffer)) == 0);
+}
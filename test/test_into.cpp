@@ -0,0 +1,91 @@
+/*
+The exception-free _into functions: the output and the status, the error offset and the consumed
+input when they stop at an invalid sequence, _append, and bounded buffers resumed until done.
+*/
+
+#include "test_util.h"
+
+static void check_utf8(const std::string& s)
+{
+    set_input(s);
+    size_t error, consumed;
+    std::u32string strict = ref_decode_utf8(s, false, error, consumed);
+    size_t lossy_error, lossy_consumed;
+    std::u32string lossy = ref_decode_utf8(s, true, lossy_error, lossy_consumed);
+    bool valid = error == npos;
+
+    // _into overwrites the string and stops in front of the invalid sequence
+    for (int replace = 0; replace < 2; ++replace)
+    {
+        const std::u32string& expected = replace ? lossy : strict;
+        std::u16string out16(5, u'x');
+        u8_conversion_result r = u8to16_into(s, out16, replace != 0);
+        CHECK(out16 == to_utf16(expected));
+        CHECK(r.output_written == out16.size());
+        if (replace || valid)
+        {
+            CHECK(r.status == u8_conversion_status::ok);
+            CHECK(r.input_consumed == s.size() && r.error_offset == s.size());
+        }
+        else
+        {
+            CHECK(r.status == u8_conversion_status::invalid_input);
+            CHECK(r.error_offset == error && r.input_consumed == consumed);
+        }
+        std::u16string appended = u"ab";
+        u8to16_append(s, appended, replace != 0);
+        CHECK(appended == u"ab" + to_utf16(expected));
+
+        size_t capacity = 2 + rng() % (rng() % 2 ? 8 : 200);
+        u8_conversion_result last;
+        size_t bounded_error;
+        std::u16string bounded16 = convert_bounded<std::u16string>(s, capacity, replace != 0,
+            [](const char* p, size_t n, char16_t* o, size_t c, bool rep) { return u8to16_into(p, n, o, c, rep); },
+            last, bounded_error);
+        CHECK(bounded16 == to_utf16(expected));
+        CHECK(bounded_error == (replace ? npos : error));
+    }
+}
+
+static void check_utf16(const std::u16string& s)
+{
+    set_input(s);
+    size_t error;
+    std::u32string strict = ref_decode_utf16(s, false, error);
+    size_t lossy_error;
+    std::u32string lossy = ref_decode_utf16(s, true, lossy_error);
+    bool valid = error == npos;
+
+    for (int replace = 0; replace < 2; ++replace)
+    {
+        const std::u32string& expected = replace ? lossy : strict;
+        std::string out8(5, 'x');
+        u8_conversion_result r = u16to8_into(s, out8, replace != 0);
+        CHECK(out8 == to_utf8(expected));
+        CHECK(r.output_written == out8.size());
+        CHECK((r.status == u8_conversion_status::ok) == (replace || valid));
+        CHECK(r.error_offset == (replace || valid ? s.size() : error));
+        std::string appended = "ab";
+        u16to8_append(s, appended, replace != 0);
+        CHECK(appended == "ab" + to_utf8(expected));
+
+        size_t capacity = 4 + rng() % (rng() % 2 ? 8 : 200);
+        u8_conversion_result last;
+        size_t bounded_error;
+        std::string bounded8 = convert_bounded<std::string>(s, capacity, replace != 0,
+            [](const char16_t* p, size_t n, char* o, size_t c, bool rep) { return u16to8_into(p, n, o, c, rep); },
+            last, bounded_error);
+        CHECK(bounded8 == to_utf8(expected));
+        CHECK(bounded_error == (replace ? npos : error));
+    }
+}
+
+void test_into(int iterations)
+{
+    current_test = "_into utf-8";
+    for (int i = 0; i < iterations; ++i)
+        check_utf8(random_utf8());
+    current_test = "_into utf-16";
+    for (int i = 0; i < iterations; ++i)
+        check_utf16(random_utf16());
+}
@@ -0,0 +1,29 @@
+/*
+u8to16_length and u16to8_length are exact for valid input.
+*/
+
+#include "test_util.h"
+
+void test_length(int iterations)
+{
+    current_test = "length utf-8";
+    for (int i = 0; i < iterations; ++i)
+    {
+        std::string s = random_utf8();
+        set_input(s);
+        size_t error, consumed;
+        std::u32string strict = ref_decode_utf8(s, false, error, consumed);
+        if (error == npos)
+            CHECK(u8to16_length(s) == to_utf16(strict).size());
+    }
+    current_test = "length utf-16";
+    for (int i = 0; i < iterations; ++i)
+    {
+        std::u16string s = random_utf16();
+        set_input(s);
+        size_t error;
+        std::u32string strict = ref_decode_utf16(s, false, error);
+        if (error == npos)
+            CHECK(u16to8_length(s) == to_utf8(strict).size());
+    }
+}
@@ -0,0 +1,114 @@
+/*
+Lossy conversion: ill-formed input is replaced like the WHATWG encoding standard requires, with
+one U+FFFD per maximal subpart of utf-8 and per unpaired surrogate of utf-16.
+*/
+
+#include "test_util.h"
+
+// Ill-formed utf-8 and the replacement the WHATWG encoding standard requires: one U+FFFD per
+// maximal subpart. error is the offset of the first invalid sequence.
+struct replacement_vector
+{
+    const char* input;
+    size_t input_len;
+    const char16_t* output;
+    size_t error;
+};
+
+#define VECTOR(input, output, error) {input, sizeof(input) - 1, output, error}
+
+static const replacement_vector whatwg_vectors[] = {
+    // truncated sequences
+    VECTOR("\xC3", u"\xFFFD", 0),
+    VECTOR("\xE2\x82", u"\xFFFD", 0),
+    VECTOR("\xE2", u"\xFFFD", 0),
+    VECTOR("\xF0\x9F\x98", u"\xFFFD", 0),
+    VECTOR("\xF0\x9F", u"\xFFFD", 0),
+    VECTOR("\xE2\x82" "A", u"\xFFFD" "A", 0),
+    VECTOR("\xF0\x9F\x98" "A", u"\xFFFD" "A", 0),
+    VECTOR("\xC3\xC3\xA9", u"\xFFFD\xE9", 0),
+    VECTOR("\xF1\x80\x80\xE1\x80\xC2", u"\xFFFD\xFFFD\xFFFD", 0),
+    // the example of the unicode standard, section 3.9
+    VECTOR("a\xF1\x80\x80\xE1\x80\xC2" "b\x80" "c\x80\xBF" "d", u"a\xFFFD\xFFFD\xFFFD" "b\xFFFD" "c\xFFFD\xFFFD" "d", 1),
+    // lone continuation bytes and bytes that never occur
+    VECTOR("\x80", u"\xFFFD", 0),
+    VECTOR("\xBF\x80", u"\xFFFD\xFFFD", 0),
+    VECTOR("\xFE", u"\xFFFD", 0),
+    VECTOR("\xFF" "a", u"\xFFFD" "a", 0),
+    // overlong encodings
+    VECTOR("\xC0\xAF", u"\xFFFD\xFFFD", 0),
+    VECTOR("\xC1\xBF", u"\xFFFD\xFFFD", 0),
+    VECTOR("\xE0\x80\xAF", u"\xFFFD\xFFFD\xFFFD", 0),
+    VECTOR("\xE0\x9F\xBF", u"\xFFFD\xFFFD\xFFFD", 0),
+    VECTOR("\xF0\x80\x80\xAF", u"\xFFFD\xFFFD\xFFFD\xFFFD", 0),
+    VECTOR("\xF0\x8F\xBF\xBF", u"\xFFFD\xFFFD\xFFFD\xFFFD", 0),
+    // surrogates
+    VECTOR("\xED\xA0\x80", u"\xFFFD\xFFFD\xFFFD", 0),
+    VECTOR("\xED\xBF\xBF", u"\xFFFD\xFFFD\xFFFD", 0),
+    VECTOR("\xED\xA0\xBD\xED\xB8\x80", u"\xFFFD\xFFFD\xFFFD\xFFFD\xFFFD\xFFFD", 0),
+    // above U+10FFFF
+    VECTOR("\xF4\x90\x80\x80", u"\xFFFD\xFFFD\xFFFD\xFFFD", 0),
+    VECTOR("\xF5\x80\x80\x80", u"\xFFFD\xFFFD\xFFFD\xFFFD", 0),
+    VECTOR("\xF7\xBF\xBF\xBF", u"\xFFFD\xFFFD\xFFFD\xFFFD", 0),
+    VECTOR("\xF8\x88\x80\x80\x80", u"\xFFFD\xFFFD\xFFFD\xFFFD\xFFFD", 0),
+    // the limits of the valid ranges
+    VECTOR("\xC2\x80\xDF\xBF\xE0\xA0\x80\xED\x9F\xBF\xEE\x80\x80\xEF\xBF\xBF",
+        u"\x0080\x07FF\x0800\xD7FF\xE000\xFFFF", npos),
+    VECTOR("\xF0\x90\x80\x80\xF4\x8F\xBF\xBF", u"\xD800\xDC00\xDBFF\xDFFF", npos),
+    VECTOR("ab\xF4\x8F\xBF", u"ab\xFFFD", 2),
+};
+
+static void check_vectors()
+{
+    current_test = "replacement vectors";
+    // alone and behind and in front of ascii runs that reach the simd kernels
+    static const size_t paddings[] = {0, 1, 15, 16, 31, 32, 33, 63, 64, 65, 100};
+    for (const replacement_vector& v : whatwg_vectors)
+    {
+        for (size_t before : paddings)
+        {
+            for (size_t after : paddings)
+            {
+                std::string s = std::string(before, 'x') + std::string(v.input, v.input_len) + std::string(after, 'y');
+                std::u16string expected = std::u16string(before, u'x') + v.output + std::u16string(after, u'y');
+                size_t error = v.error == npos ? npos : before + v.error;
+                set_input(s);
+                CHECK(u8to16(s, false) == expected);
+                size_t offset = npos;
+                CHECK(u8validate(s.data(), s.size(), &offset) == (error == npos));
+                CHECK(offset == error);
+                std::u16string out;
+                u8_conversion_result r = u8to16_into(s, out, false);
+                CHECK(r.error_offset == (error == npos ? s.size() : error));
+                // and the reference agrees
+                size_t ref_error, ref_consumed;
+                CHECK(to_utf16(ref_decode_utf8(s, true, ref_error, ref_consumed)) == expected);
+                ref_decode_utf8(s, false, ref_error, ref_consumed);
+                CHECK(ref_error == error);
+            }
+        }
+    }
+}
+
+void test_lossy(int iterations)
+{
+    check_vectors();
+    current_test = "lossy utf-8";
+    for (int i = 0; i < iterations; ++i)
+    {
+        std::string s = random_utf8();
+        set_input(s);
+        size_t error, consumed;
+        std::u32string lossy = ref_decode_utf8(s, true, error, consumed);
+        CHECK(u8to16(s, false) == to_utf16(lossy));
+    }
+    current_test = "lossy utf-16";
+    for (int i = 0; i < iterations; ++i)
+    {
+        std::u16string s = random_utf16();
+        set_input(s);
+        size_t error;
+        std::u32string lossy = ref_decode_utf16(s, true, error);
+        CHECK(u16to8(s, false) == to_utf8(lossy));
+    }
+}
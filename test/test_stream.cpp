@@ -0,0 +1,83 @@
+/*
+The stream decoder and encoder give the same result as the whole string conversion, wherever the
+chunks are split.
+*/
+
+#include "test_util.h"
+
+static void check_decoder(const std::string& s)
+{
+    set_input(s);
+    size_t error, consumed;
+    std::u32string strict = ref_decode_utf8(s, false, error, consumed);
+    size_t lossy_error, lossy_consumed;
+    std::u32string lossy = ref_decode_utf8(s, true, lossy_error, lossy_consumed);
+
+    for (int replace = 0; replace < 2; ++replace)
+    {
+        U8StreamDecoder decoder(replace != 0);
+        std::u16string streamed;
+        bool ok = true;
+        for (size_t pos = 0; ok && pos < s.size();)
+        {
+            size_t n = rng() % 9;
+            n = n < s.size() - pos ? n : s.size() - pos;
+            ok = decoder.decode(s.data() + pos, n, streamed).status == u8_conversion_status::ok;
+            pos += n;
+        }
+        if (ok)
+        {
+            char16_t tail[1];
+            u8_conversion_result finished = decoder.finish(tail);
+            ok = finished.status == u8_conversion_status::ok;
+            streamed.append(tail, finished.output_written);
+        }
+        CHECK(ok == (replace || error == npos));
+        if (ok)
+            CHECK(streamed == to_utf16(replace ? lossy : strict));
+    }
+}
+
+static void check_encoder(const std::u16string& s)
+{
+    set_input(s);
+    size_t error;
+    std::u32string strict = ref_decode_utf16(s, false, error);
+    size_t lossy_error;
+    std::u32string lossy = ref_decode_utf16(s, true, lossy_error);
+
+    for (int replace = 0; replace < 2; ++replace)
+    {
+        U8StreamEncoder encoder(replace != 0);
+        std::string streamed;
+        bool ok = true;
+        for (size_t pos = 0; ok && pos < s.size();)
+        {
+            size_t n = rng() % 6;
+            n = n < s.size() - pos ? n : s.size() - pos;
+            ok = encoder.encode(s.data() + pos, n, streamed).status == u8_conversion_status::ok;
+            pos += n;
+        }
+        if (ok)
+        {
+            // a high surrogate at the very end is only known to be unpaired here
+            char tail[3];
+            u8_conversion_result finished = encoder.finish(tail);
+            ok = finished.status == u8_conversion_status::ok;
+            streamed.append(tail, finished.output_written);
+        }
+        CHECK(ok == (replace || error == npos));
+        if (ok)
+            CHECK(streamed == to_utf8(replace ? lossy : strict));
+    }
+}
+
+void test_stream(int iterations)
+{
+    current_test = "stream decoder";
+    for (int i = 0; i < iterations; ++i)
+        check_decoder(random_utf8());
+    current_test = "stream encoder";
+    for (int i = 0; i < iterations; ++i)
+        check_encoder(random_utf16());
+}
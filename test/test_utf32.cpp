@@ -0,0 +1,154 @@
+/*
+The utf-32 family: u8to32 and u16to32, u32to8 and u32to16, their _into functions and bounded
+buffers.
+*/
+
+#include "test_util.h"
+
+static void check_from_utf8(const std::string& s)
+{
+    set_input(s);
+    size_t error, consumed;
+    std::u32string strict = ref_decode_utf8(s, false, error, consumed);
+    size_t lossy_error, lossy_consumed;
+    std::u32string lossy = ref_decode_utf8(s, true, lossy_error, lossy_consumed);
+    bool valid = error == npos;
+
+    bool threw = false;
+    try
+    {
+        CHECK(u8to32(s) == strict);
+    }
+    catch (const U8ConversionError&)
+    {
+        threw = true;
+    }
+    CHECK(threw == !valid);
+    CHECK(u8to32(s, false) == lossy);
+
+    for (int replace = 0; replace < 2; ++replace)
+    {
+        const std::u32string& expected = replace ? lossy : strict;
+        // the same status as u8to16_into
+        std::u16string out16;
+        u8_conversion_result r = u8to16_into(s, out16, replace != 0);
+        std::u32string out32(5, U'x');
+        u8_conversion_result r32 = u8to32_into(s, out32, replace != 0);
+        CHECK(out32 == expected);
+        CHECK(r32.status == r.status && r32.error_offset == r.error_offset && r32.input_consumed == r.input_consumed);
+
+        size_t capacity = 1 + rng() % (rng() % 2 ? 8 : 200);
+        u8_conversion_result last;
+        size_t bounded_error;
+        std::u32string bounded32 = convert_bounded<std::u32string>(s, capacity, replace != 0,
+            [](const char* p, size_t n, char32_t* o, size_t c, bool rep) { return u8to32_into(p, n, o, c, rep); },
+            last, bounded_error);
+        CHECK(bounded32 == expected);
+        CHECK(bounded_error == (replace ? npos : error));
+    }
+}
+
+static void check_from_utf16(const std::u16string& s)
+{
+    set_input(s);
+    size_t error;
+    std::u32string strict = ref_decode_utf16(s, false, error);
+    size_t lossy_error;
+    std::u32string lossy = ref_decode_utf16(s, true, lossy_error);
+    bool valid = error == npos;
+
+    bool threw = false;
+    try
+    {
+        CHECK(u16to32(s) == strict);
+    }
+    catch (const U8ConversionError&)
+    {
+        threw = true;
+    }
+    CHECK(threw == !valid);
+    CHECK(u16to32(s, false) == lossy);
+
+    for (int replace = 0; replace < 2; ++replace)
+    {
+        const std::u32string& expected = replace ? lossy : strict;
+        std::u32string out32;
+        u8_conversion_result r32 = u16to32_into(s, out32, replace != 0);
+        CHECK(out32 == expected);
+        CHECK((r32.status == u8_conversion_status::ok) == (replace || valid));
+        CHECK(r32.error_offset == (replace || valid ? s.size() : error));
+
+        size_t capacity = 1 + rng() % (rng() % 2 ? 8 : 200);
+        u8_conversion_result last;
+        size_t bounded_error;
+        std::u32string bounded32 = convert_bounded<std::u32string>(s, capacity, replace != 0,
+            [](const char16_t* p, size_t n, char32_t* o, size_t c, bool rep) { return u16to32_into(p, n, o, c, rep); },
+            last, bounded_error);
+        CHECK(bounded32 == expected);
+        CHECK(bounded_error == (replace ? npos : error));
+    }
+}
+
+static void check_from_utf32(const std::u32string& s)
+{
+    set_input(s);
+    size_t error;
+    std::u32string strict = ref_check_utf32(s, false, error);
+    size_t lossy_error;
+    std::u32string lossy = ref_check_utf32(s, true, lossy_error);
+    bool valid = error == npos;
+
+    bool threw = false;
+    try
+    {
+        CHECK(u32to8(s) == to_utf8(strict));
+        CHECK(u32to16(s) == to_utf16(strict));
+    }
+    catch (const U8ConversionError&)
+    {
+        threw = true;
+    }
+    CHECK(threw == !valid);
+    CHECK(u32to8(s, false) == to_utf8(lossy));
+    CHECK(u32to16(s, false) == to_utf16(lossy));
+
+    for (int replace = 0; replace < 2; ++replace)
+    {
+        const std::u32string& expected = replace ? lossy : strict;
+        std::string out8;
+        u8_conversion_result r = u32to8_into(s, out8, replace != 0);
+        CHECK(out8 == to_utf8(expected));
+        CHECK(r.error_offset == (replace || valid ? s.size() : error));
+        std::u16string out16;
+        r = u32to16_into(s, out16, replace != 0);
+        CHECK(out16 == to_utf16(expected));
+        CHECK(r.error_offset == (replace || valid ? s.size() : error));
+
+        size_t capacity = 4 + rng() % (rng() % 2 ? 8 : 200);
+        u8_conversion_result last;
+        size_t bounded_error;
+        std::string bounded8 = convert_bounded<std::string>(s, capacity, replace != 0,
+            [](const char32_t* p, size_t n, char* o, size_t c, bool rep) { return u32to8_into(p, n, o, c, rep); },
+            last, bounded_error);
+        CHECK(bounded8 == to_utf8(expected));
+        CHECK(bounded_error == (replace ? npos : error));
+        std::u16string bounded16 = convert_bounded<std::u16string>(s, capacity - 2, replace != 0,
+            [](const char32_t* p, size_t n, char16_t* o, size_t c, bool rep) { return u32to16_into(p, n, o, c, rep); },
+            last, bounded_error);
+        CHECK(bounded16 == to_utf16(expected));
+        CHECK(bounded_error == (replace ? npos : error));
+    }
+}
+
+void test_utf32(int iterations)
+{
+    current_test = "utf-32 from utf-8";
+    for (int i = 0; i < iterations; ++i)
+        check_from_utf8(random_utf8());
+    current_test = "utf-32 from utf-16";
+    for (int i = 0; i < iterations; ++i)
+        check_from_utf16(random_utf16());
+    current_test = "utf-32 to utf-8 and utf-16";
+    for (int i = 0; i < iterations; ++i)
+        check_from_utf32(random_utf32());
+}
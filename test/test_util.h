@@ -0,0 +1,348 @@
+/*
+Shared by the test files: the check macro, a simple scalar reference implementation of the
+conversions and random input. Every file tests one area and is run from main in libpu8_test.cpp.
+*/
+
+#ifndef LIBPU8_TEST_UTIL_H
+#define LIBPU8_TEST_UTIL_H
+
+#include <libpu8.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+extern int failures;
+extern const char* current_test;
+extern std::string current_input;
+
+#define CHECK(cond) \
+    do \
+    { \
+        if (!(cond)) \
+            fail(__FILE__, __LINE__, #cond); \
+    } while (0)
+
+inline void fail(const char* file, int line, const char* cond)
+{
+    if (++failures > 20)
+        return;
+    std::printf("%s: %s:%d: %s failed, input", current_test, file, line, cond);
+    for (size_t i = 0; i < current_input.size() && i < 200; ++i)
+        std::printf(" %02x", unsigned(static_cast<unsigned char>(current_input[i])));
+    std::printf("%s\n", current_input.size() > 200 ? " ..." : "");
+}
+
+template <class String>
+void set_input(const String& s)
+{
+    current_input.assign(reinterpret_cast<const char*>(s.data()), s.size() * sizeof(s[0]));
+}
+
+const size_t npos = std::string::npos;
+const char32_t replacement = 0xFFFD;
+
+// Reference conversions. They return the output up to the first invalid sequence if replace is
+// false, and set error to its offset (npos if there is none) and consumed to its end.
+
+inline std::u32string ref_decode_utf8(const std::string& s, bool replace, size_t& error, size_t& consumed)
+{
+    std::u32string out;
+    error = npos;
+    size_t i = 0;
+    while (i < s.size())
+    {
+        unsigned b = static_cast<unsigned char>(s[i]);
+        if (b < 0x80)
+        {
+            out += char32_t(b);
+            ++i;
+            continue;
+        }
+        // the well-formed byte sequences of the unicode standard, table 3-7
+        size_t need = 0;
+        unsigned lo = 0x80, hi = 0xBF;
+        if (b >= 0xC2 && b <= 0xDF)
+            need = 1;
+        else if (b == 0xE0)
+            need = 2, lo = 0xA0;
+        else if (b == 0xED)
+            need = 2, hi = 0x9F;
+        else if (b >= 0xE1 && b <= 0xEF)
+            need = 2;
+        else if (b == 0xF0)
+            need = 3, lo = 0x90;
+        else if (b == 0xF4)
+            need = 3, hi = 0x8F;
+        else if (b >= 0xF1 && b <= 0xF3)
+            need = 3;
+        uint32_t cp = b & (0x3F >> need);
+        size_t j = i + 1;
+        bool ok = need != 0;
+        for (size_t k = 0; ok && k < need; ++k)
+        {
+            unsigned c = j < s.size() ? static_cast<unsigned char>(s[j]) : 0;
+            if (j >= s.size() || c < (k ? 0x80 : lo) || c > (k ? 0xBF : hi))
+                ok = false;
+            else
+            {
+                cp = cp << 6 | (c & 0x3F);
+                ++j;
+            }
+        }
+        if (!ok)
+        {
+            // [i, j) is the maximal subpart: the lead byte and the continuation bytes valid so far
+            if (!replace)
+            {
+                error = i;
+                consumed = j;
+                return out;
+            }
+            out += replacement;
+            i = j;
+            continue;
+        }
+        out += char32_t(cp);
+        i = j;
+    }
+    consumed = s.size();
+    return out;
+}
+
+inline bool is_scalar_value(uint32_t c)
+{
+    return c < 0x110000 && (c < 0xD800 || c > 0xDFFF);
+}
+
+inline void append_utf8(std::string& s, uint32_t cp)
+{
+    if (cp < 0x80)
+        s += char(cp);
+    else if (cp < 0x800)
+    {
+        s += char(0xC0 | cp >> 6);
+        s += char(0x80 | (cp & 0x3F));
+    }
+    else if (cp < 0x10000)
+    {
+        s += char(0xE0 | cp >> 12);
+        s += char(0x80 | (cp >> 6 & 0x3F));
+        s += char(0x80 | (cp & 0x3F));
+    }
+    else
+    {
+        s += char(0xF0 | cp >> 18);
+        s += char(0x80 | (cp >> 12 & 0x3F));
+        s += char(0x80 | (cp >> 6 & 0x3F));
+        s += char(0x80 | (cp & 0x3F));
+    }
+}
+
+inline void append_utf16(std::u16string& s, uint32_t cp)
+{
+    if (cp < 0x10000)
+        s += char16_t(cp);
+    else
+    {
+        cp -= 0x10000;
+        s += char16_t(0xD800 + (cp >> 10));
+        s += char16_t(0xDC00 + (cp & 0x3FF));
+    }
+}
+
+inline std::u32string ref_decode_utf16(const std::u16string& s, bool replace, size_t& error)
+{
+    std::u32string out;
+    error = npos;
+    for (size_t i = 0; i < s.size(); ++i)
+    {
+        uint32_t u = s[i];
+        if (u >= 0xD800 && u < 0xDC00 && i + 1 < s.size() && s[i + 1] >= 0xDC00 && s[i + 1] < 0xE000)
+            u = 0x10000 + ((u - 0xD800) << 10) + (s[++i] - 0xDC00);
+        else if (u >= 0xD800 && u < 0xE000)
+        {
+            if (!replace)
+            {
+                error = i;
+                return out;
+            }
+            u = replacement;
+        }
+        out += char32_t(u);
+    }
+    return out;
+}
+
+inline std::u32string ref_check_utf32(const std::u32string& s, bool replace, size_t& error)
+{
+    std::u32string out;
+    error = npos;
+    for (size_t i = 0; i < s.size(); ++i)
+    {
+        if (is_scalar_value(s[i]))
+            out += s[i];
+        else if (!replace)
+        {
+            error = i;
+            return out;
+        }
+        else
+            out += replacement;
+    }
+    return out;
+}
+
+inline std::string to_utf8(const std::u32string& s)
+{
+    std::string out;
+    for (char32_t c : s)
+        append_utf8(out, c);
+    return out;
+}
+
+inline std::u16string to_utf16(const std::u32string& s)
+{
+    std::u16string out;
+    for (char32_t c : s)
+        append_utf16(out, c);
+    return out;
+}
+
+// Random input. Long runs of one kind of character reach the simd kernels, mixed text and invalid
+// sequences make them fall back to the scalar code at every position.
+
+extern std::mt19937 rng;
+
+inline size_t random_length()
+{
+    static const size_t boundaries[] = {0, 1, 2, 3, 4, 7, 8, 15, 16, 17, 31, 32, 33, 47, 48, 63, 64, 65,
+        95, 96, 97, 127, 128, 129, 191, 255, 256, 257, 1023, 4095, 4096, 4097};
+    if (rng() % 2)
+        return boundaries[rng() % (sizeof(boundaries) / sizeof(boundaries[0]))];
+    return rng() % (rng() % 4 ? 300 : 3000);
+}
+
+inline uint32_t random_code_point(unsigned bytes)
+{
+    switch (bytes)
+    {
+    case 1: return rng() % 0x80;
+    case 2: return 0x80 + rng() % 0x780;
+    case 3:
+    {
+        uint32_t c = 0x800 + rng() % 0xF000;
+        return c >= 0xD800 ? c + 0x800 : c;
+    }
+    default: return 0x10000 + rng() % 0x100000;
+    }
+}
+
+inline std::string random_utf8()
+{
+    static const char* const invalid_utf8[] = {"\x80", "\xBF", "\xC0\xAF", "\xC1\xBF", "\xC2", "\xDF", "\xE0\x80\x80",
+        "\xE0\x9F\xBF", "\xE2\x82", "\xED\xA0\x80", "\xED\xBF\xBF", "\xEF\xBF", "\xF0\x80\x80\x80", "\xF0\x8F\xBF\xBF",
+        "\xF0\x9F\x98", "\xF4\x90\x80\x80", "\xF4\x8F\xBF", "\xF5\x80\x80\x80", "\xF8\x88\x80\x80\x80", "\xFE", "\xFF"};
+    size_t len = random_length();
+    // mostly one kind of code point, sometimes a mix of all
+    unsigned kind = rng() % 5;
+    unsigned invalid_per_mille = rng() % 3 ? 0 : 1 + rng() % 50;
+    std::string s;
+    while (s.size() < len)
+    {
+        if (invalid_per_mille && rng() % 1000 < invalid_per_mille)
+        {
+            if (rng() % 4)
+                s += invalid_utf8[rng() % (sizeof(invalid_utf8) / sizeof(invalid_utf8[0]))];
+            else
+                s += char(rng());
+        }
+        else
+            append_utf8(s, random_code_point(kind == 4 || rng() % 16 == 0 ? 1 + rng() % 4 : kind + 1));
+    }
+    // cut a sequence at the end now and then
+    if (s.size() > len && rng() % 2)
+        s.resize(len);
+    return s;
+}
+
+inline std::u32string random_utf32()
+{
+    size_t len = random_length();
+    unsigned kind = rng() % 5;
+    bool invalid = rng() % 3 == 0;
+    std::u32string s;
+    for (size_t i = 0; i < len; ++i)
+    {
+        unsigned r = rng() % 200;
+        if (invalid && r == 0)
+            s += char32_t(0xD800 + rng() % 0x800);
+        else if (invalid && r == 1)
+            s += char32_t(0x110000 + rng() % 0x1000);
+        else if (invalid && r == 2)
+            s += char32_t(rng() | 0x80000000u);
+        else
+            s += char32_t(random_code_point(kind == 4 || rng() % 16 == 0 ? 1 + rng() % 4 : kind + 1));
+    }
+    return s;
+}
+
+inline std::u16string random_utf16()
+{
+    std::u16string s;
+    for (char32_t c : random_utf32())
+    {
+        if (is_scalar_value(c))
+            append_utf16(s, c);
+        else
+            s += char16_t(0xD800 + rng() % 0x800); // an unpaired surrogate, unless it happens to pair
+    }
+    return s;
+}
+
+// Converts in with a bounded buffer of capacity code units, resuming after every output_too_small
+// until the conversion is done or stops at invalid input. Returns the concatenated output.
+template <class Out, class In, class Convert>
+Out convert_bounded(const In& in, size_t capacity, bool replace, Convert convert, u8_conversion_result& last,
+    size_t& error)
+{
+    std::vector<typename Out::value_type> buffer(capacity + 1, typename Out::value_type(0x5A));
+    Out out;
+    size_t pos = 0;
+    error = npos;
+    for (;;)
+    {
+        last = convert(in.data() + pos, in.size() - pos, buffer.data(), capacity, replace);
+        CHECK(last.output_written <= capacity);
+        CHECK(buffer[capacity] == typename Out::value_type(0x5A));
+        out.append(buffer.data(), last.output_written);
+        if (last.status == u8_conversion_status::invalid_input)
+            error = pos + last.error_offset;
+        pos += last.input_consumed;
+        if (last.status != u8_conversion_status::output_too_small)
+            break;
+        // a buffer that holds the longest sequence always makes progress
+        CHECK(last.input_consumed > 0);
+        CHECK(last.error_offset == last.input_consumed);
+        if (!last.input_consumed)
+            break;
+    }
+    if (last.status == u8_conversion_status::ok)
+        CHECK(pos == in.size());
+    return out;
+}
+
+// The tests, one file per area. iterations is the number of random inputs.
+void test_conversions(int iterations);
+void test_validate(int iterations);
+void test_into(int iterations);
+void test_length(int iterations);
+void test_view(int iterations);
+void test_stream(int iterations);
+void test_console(int iterations);
+void test_lossy(int iterations);
+void test_utf32(int iterations);
+
+#endif
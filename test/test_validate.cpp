@@ -0,0 +1,22 @@
+/*
+u8validate of random input: the result and the offset of the first invalid sequence.
+*/
+
+#include "test_util.h"
+
+void test_validate(int iterations)
+{
+    current_test = "u8validate";
+    for (int i = 0; i < iterations; ++i)
+    {
+        std::string s = random_utf8();
+        set_input(s);
+        size_t error, consumed;
+        ref_decode_utf8(s, false, error, consumed);
+        // the offset is only written on failure
+        size_t offset = npos;
+        CHECK(u8validate(s.data(), s.size(), &offset) == (error == npos));
+        CHECK(offset == error);
+        CHECK(u8validate(s.data(), s.size()) == (error == npos));
+    }
+}
@@ -0,0 +1,45 @@
+/*
+u8widen_view refers to its argument on non-windows systems, so it must not accept a temporary
+std::string: auto p = u8widen_view(a + b) would dangle.
+*/
+
+#include "test_util.h"
+
+#include <cstring>
+#include <type_traits>
+#include <utility>
+
+template <class T, class = void>
+struct accepts_view : std::false_type
+{
+};
+
+template <class T>
+struct accepts_view<T, decltype(void(u8widen_view(std::declval<T>())))> : std::true_type
+{
+};
+
+static_assert(!accepts_view<std::string>::value, "u8widen_view must not accept a temporary std::string");
+static_assert(!accepts_view<std::string&&>::value, "u8widen_view must not accept a temporary std::string");
+static_assert(accepts_view<const std::string&>::value, "u8widen_view takes a std::string lvalue");
+static_assert(accepts_view<std::string&>::value, "u8widen_view takes a std::string lvalue");
+static_assert(accepts_view<const char*>::value, "u8widen_view takes a c string");
+
+void test_view(int iterations)
+{
+    current_test = "u8widen_view";
+    for (int i = 0; i < iterations; ++i)
+    {
+        size_t error;
+        std::string s = to_utf8(ref_check_utf32(random_utf32(), true, error));
+        set_input(s);
+        U8PathArg view = u8widen_view(s);
+#ifdef _WIN32
+        CHECK(std::wstring(view.c_str(), view.size()) == u8widen(s));
+#else
+        // neither converted nor copied
+        CHECK(view.c_str() == s.c_str() && view.size() == s.size());
+        CHECK(u8widen_view(s.c_str()).size() == std::strlen(s.c_str()));
+#endif
+    }
+}